@@ -0,0 +1,114 @@
+// Stand-in for the AFL++ forkserver, used by bench_afl_init.sh when afl-fuzz is
+// not installed. Force-included in fuzz/generic_test.c (gcc -include), it forks
+// one child per test case at the point the AFL++ forkserver would start: in a
+// constructor before main() with AFL_DEFERRED_INIT=0, at __AFL_INIT() otherwise.
+// As afl-fuzz does, it writes every test case to the file given as @@ before the
+// fork, and sends the output of the children to /dev/null. Only the fork point
+// differs between the two builds, so their exec/s show what the deferral saves.
+//
+// Environment: AFL_EMU_CASES directory of the test cases (read in turn),
+// AFL_EMU_INPUT file read by the children, AFL_EMU_SECONDS duration (default 10),
+// AFL_EMU_STATS file receiving "execs_per_sec : <n>" as in fuzzer_stats
+#ifndef AFL_FORKSERVER_EMU_H
+#define AFL_FORKSERVER_EMU_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Same configuration as the afl-clang-fast builds (watchdog compiled out)
+#define __AFL_COMPILER 1
+#define __AFL_HAVE_MANUAL_CONTROL 1
+#define __AFL_INIT() afl_emu_forkserver()
+
+/// @brief Copies a test case to the input file of the children
+static int afl_emu_write_case(const char *dir, const char *name, const char *input)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    int in = open(path, O_RDONLY);
+    if(in < 0) return -1;
+    int out = open(input, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out < 0) { close(in); return -1; }
+
+    char buf[64 * 1024];
+    ssize_t n;
+    int ret = 0;
+    while((n = read(in, buf, sizeof(buf))) > 0)
+    {
+        if(write(out, buf, n) != n) { ret = -1; break; }
+    }
+    close(in);
+    close(out);
+    return ret;
+}
+
+/// @brief Forks a child per test case until the duration is over, then exits with
+/// the exec/s; the children return to run the test case
+static void afl_emu_forkserver(void)
+{
+    const char *dir = getenv("AFL_EMU_CASES");
+    const char *input = getenv("AFL_EMU_INPUT");
+    const char *stats = getenv("AFL_EMU_STATS");
+    double seconds = getenv("AFL_EMU_SECONDS") ? atof(getenv("AFL_EMU_SECONDS")) : 10;
+
+    // Not under the benchmark: run as a normal build
+    if(dir == NULL || input == NULL) return;
+
+    struct dirent **cases;
+    int num_cases = scandir(dir, &cases, NULL, alphasort);
+    if(num_cases <= 0) _exit(1);
+
+    int null_fd = open("/dev/null", O_RDWR);
+    unsigned long execs = 0;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double elapsed = 0;
+
+    for(int i = 0; elapsed < seconds; i = (i + 1) % num_cases)
+    {
+        if(cases[i]->d_name[0] == '.') continue;
+        if(afl_emu_write_case(dir, cases[i]->d_name, input)) _exit(1);
+
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+            return;
+        }
+        if(pid < 0) _exit(1);
+
+        int status;
+        waitpid(pid, &status, 0);
+        execs++;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    }
+
+    FILE *f = stats != NULL ? fopen(stats, "w") : NULL;
+    if(f != NULL)
+    {
+        fprintf(f, "execs_done        : %lu\nexecs_per_sec     : %.2f\n", execs, execs / elapsed);
+        fclose(f);
+    }
+    fprintf(stderr, "%lu executions in %.1f s: %.2f exec/s\n", execs, elapsed, execs / elapsed);
+    _exit(0);
+}
+
+#if defined(AFL_DEFERRED_INIT) && AFL_DEFERRED_INIT == 0
+__attribute__((constructor)) static void afl_emu_early_forkserver(void)
+{
+    afl_emu_forkserver();
+}
+#endif
+
+#endif
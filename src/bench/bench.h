@@ -0,0 +1,130 @@
+// Helpers shared by the libspng benchmarks in bench/: timing, loading the
+// images of a directory and printing JSON. The benchmarks print one JSON
+// document to stdout and their progress to stderr.
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <spng.h>
+
+/// @brief Image file loaded in memory
+struct bench_image {
+    char name[256]; // file name, without the directory
+    uint8_t *data;
+    size_t size;
+};
+
+/// @brief Output formats of spng_decode_image, with their names in the JSON
+static const struct {
+    int fmt;
+    const char *name;
+} bench_formats[] = {
+    {SPNG_FMT_RGBA8, "RGBA8"}, {SPNG_FMT_RGBA16, "RGBA16"}, {SPNG_FMT_RGB8, "RGB8"},
+    {SPNG_FMT_GA8, "GA8"}, {SPNG_FMT_GA16, "GA16"}, {SPNG_FMT_G8, "G8"},
+    {SPNG_FMT_PNG, "PNG"}, {SPNG_FMT_RAW, "RAW"}
+};
+
+#define BENCH_NUM_FORMATS (sizeof(bench_formats) / sizeof(bench_formats[0]))
+
+/// @brief Monotonic time in nanoseconds
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline int bench_compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/// @brief Sorts the samples and returns the percentile p (0-100) of them
+static inline uint64_t bench_percentile(uint64_t *samples, size_t n, double p)
+{
+    if(n == 0) return 0;
+    qsort(samples, n, sizeof(uint64_t), bench_compare_u64);
+
+    size_t idx = (size_t)(p / 100.0 * (double)(n - 1) + 0.5);
+    return samples[idx < n ? idx : n - 1];
+}
+
+static inline int bench_is_png(const struct dirent *entry)
+{
+    size_t len = strlen(entry->d_name);
+    return entry->d_name[0] != '.' && len > 4 && strcmp(entry->d_name + len - 4, ".png") == 0;
+}
+
+/// @brief Loads the .png files of dir in name order
+/// @param images - set to an array of the images, to free with bench_free_images
+/// @return - number of images loaded, -1 if dir can't be read
+static inline int bench_load_images(const char *dir, struct bench_image **images)
+{
+    struct dirent **entries;
+    int n = scandir(dir, &entries, bench_is_png, alphasort);
+    if(n < 0) return -1;
+
+    *images = (struct bench_image*)calloc(n > 0 ? n : 1, sizeof(struct bench_image));
+    int count = 0;
+
+    for(int i = 0; i < n; i++)
+    {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+
+        FILE *file = fopen(path, "rb");
+        if(file != NULL)
+        {
+            struct bench_image *image = &(*images)[count];
+            fseek(file, 0, SEEK_END);
+            long size = ftell(file);
+            fseek(file, 0, SEEK_SET);
+
+            image->data = size > 0 ? (uint8_t*)malloc(size) : NULL;
+            if(image->data != NULL && fread(image->data, 1, size, file) == (size_t)size)
+            {
+                snprintf(image->name, sizeof(image->name), "%s", entries[i]->d_name);
+                image->size = size;
+                count++;
+            }
+            else
+            {
+                free(image->data);
+                image->data = NULL;
+            }
+            fclose(file);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    return count;
+}
+
+static inline void bench_free_images(struct bench_image *images, int count)
+{
+    for(int i = 0; i < count; i++) free(images[i].data);
+    free(images);
+}
+
+/// @brief Prints str as a JSON string, with its quotes
+static inline void bench_json_string(const char *str)
+{
+    putchar('"');
+    for(; *str; str++)
+    {
+        if(*str == '"' || *str == '\\') printf("\\%c", *str);
+        else if((unsigned char)*str < 0x20) printf("\\u%04x", *str);
+        else putchar(*str);
+    }
+    putchar('"');
+}
+
+#endif
@@ -0,0 +1,369 @@
+// Decode throughput of libspng over a corpus: every image is decoded runs times
+// with spng_decode_image into every output format, each run in a fresh context
+// as in the harness. The JSON printed to stdout has, per image and format,
+// the median time of a decode, the MB/s of input and of output, and the ns per
+// pixel; "by_type" averages the ns per pixel by color type, bit depth,
+// interlacing and format, to spot the slow combinations.
+//
+// With -r it compares instead the progressive decode (SPNG_DECODE_PROGRESSIVE, one
+// spng_decode_row per row) to the one-shot spng_decode_image, in RGBA8: every
+// spng_decode_row call is timed, and the JSON has per image the p50/p90/p99/max
+// latency of a row and the overhead of the progressive decode over the one-shot one.
+//
+// Usage: ./bench/bench_decode.bench [-r] [-n runs] [image_dir]
+
+#include <unistd.h>
+
+#include "bench.h"
+
+// decodes of every image and format, after one untimed warm-up decode
+#define DEFAULT_RUNS 10
+
+/// @brief Average ns per pixel of a (color type, bit depth, interlace, format) group
+struct type_stats {
+    int color_type;
+    int bit_depth;
+    int interlace;
+    size_t format;
+    int images;
+    double ns_per_pixel_sum;
+};
+
+static struct type_stats *type_stats = NULL;
+static size_t num_type_stats = 0;
+
+static void add_type_stats(const struct spng_ihdr *ihdr, size_t format, double ns_per_pixel)
+{
+    struct type_stats *stats = NULL;
+    for(size_t i = 0; i < num_type_stats; i++)
+    {
+        struct type_stats *s = &type_stats[i];
+        if(s->color_type == ihdr->color_type && s->bit_depth == ihdr->bit_depth &&
+           s->interlace == ihdr->interlace_method && s->format == format)
+        {
+            stats = s;
+            break;
+        }
+    }
+
+    if(stats == NULL)
+    {
+        struct type_stats *grown = (struct type_stats*)realloc(type_stats, (num_type_stats + 1) * sizeof(struct type_stats));
+        if(grown == NULL) return;
+        type_stats = grown;
+        stats = &type_stats[num_type_stats++];
+        stats->color_type = ihdr->color_type;
+        stats->bit_depth = ihdr->bit_depth;
+        stats->interlace = ihdr->interlace_method;
+        stats->format = format;
+        stats->images = 0;
+        stats->ns_per_pixel_sum = 0;
+    }
+
+    stats->images++;
+    stats->ns_per_pixel_sum += ns_per_pixel;
+}
+
+/// @brief Decodes an image once in a fresh context
+/// @return - 0 on success, the libspng error otherwise
+static int decode_once(const struct bench_image *image, int fmt, void *out, size_t out_size)
+{
+    spng_ctx *ctx = spng_ctx_new(0);
+    if(ctx == NULL) return SPNG_EMEM;
+
+    int ret = spng_set_png_buffer(ctx, image->data, image->size);
+    if(!ret) ret = spng_decode_image(ctx, out, out_size, fmt, 0);
+
+    spng_ctx_free(ctx);
+    return ret;
+}
+
+/// @brief Decodes an image once progressively in a fresh context, timing every row
+/// @param row_samples - receives the ns of every spng_decode_row call
+/// @param num_rows - set to the number of rows decoded
+/// @return - 0 on success, the libspng error otherwise
+static int decode_rows_once(const struct bench_image *image, void *row, size_t row_size,
+                            uint64_t *row_samples, size_t max_rows, size_t *num_rows)
+{
+    spng_ctx *ctx = spng_ctx_new(0);
+    if(ctx == NULL) return SPNG_EMEM;
+
+    *num_rows = 0;
+
+    int ret = spng_set_png_buffer(ctx, image->data, image->size);
+    if(!ret) ret = spng_decode_image(ctx, NULL, 0, SPNG_FMT_RGBA8, SPNG_DECODE_PROGRESSIVE);
+
+    // The last row returns SPNG_EOI
+    while(!ret && *num_rows < max_rows)
+    {
+        struct spng_row_info row_info;
+        ret = spng_get_row_info(ctx, &row_info);
+        if(ret) break;
+
+        uint64_t start = bench_now_ns();
+        ret = spng_decode_row(ctx, row, row_size);
+        row_samples[(*num_rows)++] = bench_now_ns() - start;
+    }
+
+    spng_ctx_free(ctx);
+
+    // max_rows rows without SPNG_EOI: the row count of the image is wrong
+    if(!ret) return SPNG_EINTERNAL;
+    return ret == SPNG_EOI ? 0 : ret;
+}
+
+/// @brief Number of spng_decode_row calls of a progressive decode: one per line
+/// of every non-empty Adam7 pass for interlaced images, at most 2 * height + 3
+static size_t decoded_rows(const struct spng_ihdr *ihdr)
+{
+    if(!ihdr->interlace_method) return ihdr->height;
+
+    static const uint32_t x_start[7] = {0, 4, 0, 2, 0, 1, 0};
+    static const uint32_t y_start[7] = {0, 0, 4, 0, 2, 0, 1};
+    static const uint32_t y_delta[7] = {8, 8, 8, 4, 4, 2, 2};
+
+    size_t rows = 0;
+    for(int pass = 0; pass < 7; pass++)
+    {
+        if(ihdr->width <= x_start[pass] || ihdr->height <= y_start[pass]) continue;
+        rows += (ihdr->height - y_start[pass] + y_delta[pass] - 1) / y_delta[pass];
+    }
+    return rows;
+}
+
+/// @brief Reads the header of an image and the output size of every format
+/// @return - 0 on success, the libspng error otherwise
+static int read_header(const struct bench_image *image, struct spng_ihdr *ihdr, size_t out_sizes[], int out_errors[])
+{
+    spng_ctx *ctx = spng_ctx_new(0);
+    if(ctx == NULL) return SPNG_EMEM;
+
+    int ret = spng_set_png_buffer(ctx, image->data, image->size);
+    if(!ret) ret = spng_get_ihdr(ctx, ihdr);
+
+    for(size_t f = 0; !ret && f < BENCH_NUM_FORMATS; f++)
+        out_errors[f] = spng_decoded_image_size(ctx, bench_formats[f].fmt, &out_sizes[f]);
+
+    spng_ctx_free(ctx);
+    return ret;
+}
+
+/// @brief Benchmarks one image in every format and prints its JSON object
+static void bench_image(const struct bench_image *image, int runs, uint64_t *samples)
+{
+    struct spng_ihdr ihdr;
+    size_t out_sizes[BENCH_NUM_FORMATS];
+    int out_errors[BENCH_NUM_FORMATS];
+
+    printf("    {\"file\": ");
+    bench_json_string(image->name);
+    printf(", \"input_bytes\": %zu", image->size);
+
+    int ret = read_header(image, &ihdr, out_sizes, out_errors);
+    if(ret)
+    {
+        printf(", \"error\": ");
+        bench_json_string(spng_strerror(ret));
+        printf("}");
+        return;
+    }
+
+    double pixels = (double)ihdr.width * ihdr.height;
+    printf(", \"width\": %u, \"height\": %u, \"color_type\": %d, \"bit_depth\": %d, \"interlace\": %d,\n",
+           ihdr.width, ihdr.height, ihdr.color_type, ihdr.bit_depth, ihdr.interlace_method);
+    printf("     \"formats\": [\n");
+
+    for(size_t f = 0; f < BENCH_NUM_FORMATS; f++)
+    {
+        printf("      {\"format\": \"%s\"", bench_formats[f].name);
+
+        void *out = out_errors[f] ? NULL : malloc(out_sizes[f]);
+        if(!out_errors[f] && out == NULL) out_errors[f] = SPNG_EMEM;
+
+        // Warm-up: caches, page faults of the output buffer and the error check
+        ret = out_errors[f] ? out_errors[f] : decode_once(image, bench_formats[f].fmt, out, out_sizes[f]);
+        if(ret)
+        {
+            printf(", \"error\": ");
+            bench_json_string(spng_strerror(ret));
+        }
+        else
+        {
+            for(int run = 0; run < runs; run++)
+            {
+                uint64_t start = bench_now_ns();
+                decode_once(image, bench_formats[f].fmt, out, out_sizes[f]);
+                samples[run] = bench_now_ns() - start;
+            }
+
+            double ns_min = (double)bench_percentile(samples, runs, 0);
+            double ns = (double)bench_percentile(samples, runs, 50);
+            double ns_per_pixel = ns / pixels;
+
+            // bytes per ns * 1000 = MB/s
+            printf(", \"output_bytes\": %zu, \"ns\": %.0f, \"ns_min\": %.0f, \"input_mb_s\": %.2f, \"output_mb_s\": %.2f, \"ns_per_pixel\": %.3f",
+                   out_sizes[f], ns, ns_min, image->size / ns * 1000.0, out_sizes[f] / ns * 1000.0, ns_per_pixel);
+
+            add_type_stats(&ihdr, f, ns_per_pixel);
+        }
+        printf("}%s\n", f + 1 < BENCH_NUM_FORMATS ? "," : "");
+
+        free(out);
+    }
+
+    printf("     ]}");
+}
+
+/// @brief Progressive vs one-shot decode of an image in RGBA8, prints its JSON object
+/// @param totals - one-shot and progressive ns, summed over the images
+static void bench_image_rows(const struct bench_image *image, int runs, uint64_t *samples, uint64_t totals[2])
+{
+    struct spng_ihdr ihdr;
+    size_t out_sizes[BENCH_NUM_FORMATS];
+    int out_errors[BENCH_NUM_FORMATS];
+
+    printf("    {\"file\": ");
+    bench_json_string(image->name);
+
+    int ret = read_header(image, &ihdr, out_sizes, out_errors);
+    if(!ret) ret = out_errors[0]; // RGBA8
+    if(ret)
+    {
+        printf(", \"error\": ");
+        bench_json_string(spng_strerror(ret));
+        printf("}");
+        return;
+    }
+
+    size_t row_size = out_sizes[0] / ihdr.height;
+    size_t max_rows = decoded_rows(&ihdr);
+    void *out = malloc(out_sizes[0]);
+    uint64_t *row_samples = (uint64_t*)malloc((size_t)runs * max_rows * sizeof(uint64_t));
+    size_t num_samples = 0;
+    size_t num_rows = 0;
+    uint64_t progressive_ns[runs];
+
+    ret = out == NULL || row_samples == NULL ? SPNG_EMEM : decode_once(image, SPNG_FMT_RGBA8, out, out_sizes[0]);
+    for(int run = 0; !ret && run < runs; run++)
+    {
+        uint64_t start = bench_now_ns();
+        decode_once(image, SPNG_FMT_RGBA8, out, out_sizes[0]);
+        samples[run] = bench_now_ns() - start;
+
+        start = bench_now_ns();
+        ret = decode_rows_once(image, out, row_size, row_samples + num_samples, max_rows, &num_rows);
+        progressive_ns[run] = bench_now_ns() - start;
+        num_samples += num_rows;
+    }
+
+    if(ret)
+    {
+        printf(", \"error\": ");
+        bench_json_string(spng_strerror(ret));
+    }
+    else
+    {
+        uint64_t oneshot = bench_percentile(samples, runs, 50);
+        uint64_t progressive = bench_percentile(progressive_ns, runs, 50);
+        totals[0] += oneshot;
+        totals[1] += progressive;
+
+        printf(", \"width\": %u, \"height\": %u, \"color_type\": %d, \"bit_depth\": %d, \"interlace\": %d, \"rows\": %zu,\n",
+               ihdr.width, ihdr.height, ihdr.color_type, ihdr.bit_depth, ihdr.interlace_method, num_rows);
+        printf("     \"oneshot_ns\": %llu, \"progressive_ns\": %llu, \"overhead_pct\": %.1f,\n",
+               (unsigned long long)oneshot, (unsigned long long)progressive, 100.0 * ((double)progressive / oneshot - 1));
+        printf("     \"row_ns\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}",
+               (unsigned long long)bench_percentile(row_samples, num_samples, 50),
+               (unsigned long long)bench_percentile(row_samples, num_samples, 90),
+               (unsigned long long)bench_percentile(row_samples, num_samples, 99),
+               (unsigned long long)bench_percentile(row_samples, num_samples, 100));
+    }
+    printf("}");
+
+    free(row_samples);
+    free(out);
+}
+
+int main(int argc, char **argv)
+{
+    int runs = DEFAULT_RUNS;
+    int rows_mode = 0;
+    const char *image_dir = "images";
+
+    int opt;
+    while((opt = getopt(argc, argv, "rn:")) != -1)
+    {
+        if(opt == 'n') runs = atoi(optarg);
+        else if(opt == 'r') rows_mode = 1;
+        else
+        {
+            fprintf(stderr, "Usage: %s [-r] [-n runs] [image_dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc) image_dir = argv[optind];
+    if(runs < 1) runs = 1;
+
+    struct bench_image *images;
+    int num_images = bench_load_images(image_dir, &images);
+    if(num_images <= 0)
+    {
+        fprintf(stderr, "No images in %s\n", image_dir);
+        return 1;
+    }
+
+    uint64_t *samples = (uint64_t*)malloc(runs * sizeof(uint64_t));
+
+    if(rows_mode)
+    {
+        uint64_t totals[2] = {0, 0};
+
+        printf("{\"benchmark\": \"decode_rows\", \"libspng_version\": ");
+        bench_json_string(spng_version_string());
+        printf(", \"format\": \"RGBA8\", \"runs\": %d,\n  \"images\": [\n", runs);
+
+        for(int i = 0; i < num_images; i++)
+        {
+            fprintf(stderr, "\rDecoding %d/%d %s          ", i + 1, num_images, images[i].name);
+            bench_image_rows(&images[i], runs, samples, totals);
+            printf("%s\n", i + 1 < num_images ? "," : "");
+        }
+        fprintf(stderr, "\n");
+
+        printf("  ],\n  \"oneshot_ns\": %llu, \"progressive_ns\": %llu, \"overhead_pct\": %.1f\n}\n",
+               (unsigned long long)totals[0], (unsigned long long)totals[1],
+               totals[0] ? 100.0 * ((double)totals[1] / totals[0] - 1) : 0.0);
+
+        free(samples);
+        bench_free_images(images, num_images);
+        return 0;
+    }
+
+    printf("{\"benchmark\": \"decode\", \"libspng_version\": ");
+    bench_json_string(spng_version_string());
+    printf(", \"runs\": %d,\n  \"images\": [\n", runs);
+
+    for(int i = 0; i < num_images; i++)
+    {
+        fprintf(stderr, "\rDecoding %d/%d %s          ", i + 1, num_images, images[i].name);
+        bench_image(&images[i], runs, samples);
+        printf("%s\n", i + 1 < num_images ? "," : "");
+    }
+    fprintf(stderr, "\n");
+
+    printf("  ],\n  \"by_type\": [\n");
+    for(size_t i = 0; i < num_type_stats; i++)
+    {
+        const struct type_stats *s = &type_stats[i];
+        printf("    {\"color_type\": %d, \"bit_depth\": %d, \"interlace\": %d, \"format\": \"%s\", \"images\": %d, \"ns_per_pixel\": %.3f}%s\n",
+               s->color_type, s->bit_depth, s->interlace, bench_formats[s->format].name, s->images,
+               s->ns_per_pixel_sum / s->images, i + 1 < num_type_stats ? "," : "");
+    }
+    printf("  ]\n}\n");
+
+    free(type_stats);
+    free(samples);
+    bench_free_images(images, num_images);
+
+    return 0;
+}
@@ -0,0 +1,323 @@
+// Encoder settings benchmark: every image of the corpus that decodes is encoded
+// again with each point of the grid of SPNG_IMG_COMPRESSION_LEVEL (0-9),
+// SPNG_IMG_WINDOW_BITS (8-15), SPNG_IMG_MEM_LEVEL (1-9) and
+// SPNG_IMG_COMPRESSION_STRATEGY (0-4), the ranges of choose_random_options in
+// fuzz/generic_test.c. The image keeps its own IHDR, palette and transparency.
+// The JSON printed to stdout has, per grid point, the encode time and output
+// size summed over the corpus and the peak bytes allocated by libspng for one
+// image, then the Pareto front of the points: those that no other point beats
+// on time, size and memory at once.
+//
+// Usage: ./bench/bench_encode.bench [-n runs] [image_dir]
+
+#include <unistd.h>
+
+#include "bench.h"
+
+// encodes of every image at every grid point (median taken)
+#define DEFAULT_RUNS 1
+
+#define MIN_LEVEL 0
+#define MAX_LEVEL 9
+#define MIN_WINDOW_BITS 8
+#define MAX_WINDOW_BITS 15
+#define MIN_MEM_LEVEL 1
+#define MAX_MEM_LEVEL 9
+#define MIN_STRATEGY 0
+#define MAX_STRATEGY 4
+
+#define NUM_POINTS ((MAX_LEVEL - MIN_LEVEL + 1) * (MAX_WINDOW_BITS - MIN_WINDOW_BITS + 1) * \
+                    (MAX_MEM_LEVEL - MIN_MEM_LEVEL + 1) * (MAX_STRATEGY - MIN_STRATEGY + 1))
+
+/// @brief Decoded image of the corpus, in its own format (SPNG_FMT_PNG)
+struct source_image {
+    const char *name;
+    struct spng_ihdr ihdr;
+    struct spng_plte plte;
+    struct spng_trns trns;
+    int has_plte;
+    int has_trns;
+    void *data;
+    size_t size;
+};
+
+/// @brief Encoder settings and their results over the corpus
+struct grid_point {
+    int level;
+    int window_bits;
+    int mem_level;
+    int strategy;
+    uint64_t encode_ns;
+    uint64_t output_bytes;
+    size_t peak_bytes; // largest over the images
+    int errors; // images the encoder rejected
+};
+
+/////////////////////////////////////////////
+// COUNTING ALLOCATOR:
+/////////////////////////////////////////////
+
+// keeps the blocks 16-byte aligned, as malloc does
+#define HEADER_SIZE 16
+
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+
+static void *counting_malloc(size_t size)
+{
+    uint8_t *block = (uint8_t*)malloc(HEADER_SIZE + size);
+    if(block == NULL) return NULL;
+
+    *(size_t*)block = size;
+    live_bytes += size;
+    if(live_bytes > peak_bytes) peak_bytes = live_bytes;
+
+    return block + HEADER_SIZE;
+}
+
+static void counting_free(void *ptr)
+{
+    if(ptr == NULL) return;
+
+    uint8_t *block = (uint8_t*)ptr - HEADER_SIZE;
+    live_bytes -= *(size_t*)block;
+    free(block);
+}
+
+static void *counting_realloc(void *ptr, size_t size)
+{
+    if(ptr == NULL) return counting_malloc(size);
+
+    size_t old_size = *(size_t*)((uint8_t*)ptr - HEADER_SIZE);
+    void *new_ptr = counting_malloc(size);
+    if(new_ptr == NULL) return NULL;
+
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    counting_free(ptr);
+
+    return new_ptr;
+}
+
+static void *counting_calloc(size_t count, size_t size)
+{
+    if(size && count > SIZE_MAX / size) return NULL;
+
+    void *ptr = counting_malloc(count * size);
+    if(ptr != NULL) memset(ptr, 0, count * size);
+
+    return ptr;
+}
+
+static struct spng_alloc counting_alloc = {counting_malloc, counting_realloc, counting_calloc, counting_free};
+
+/////////////////////////////////////////////
+// BENCHMARK:
+/////////////////////////////////////////////
+
+/// @brief Decodes an image of the corpus in its own format
+/// @return - 0 on success, the libspng error otherwise
+static int load_source(const struct bench_image *image, struct source_image *source)
+{
+    memset(source, 0, sizeof(*source));
+    source->name = image->name;
+
+    spng_ctx *ctx = spng_ctx_new(0);
+    if(ctx == NULL) return SPNG_EMEM;
+
+    int ret = spng_set_png_buffer(ctx, image->data, image->size);
+    if(!ret) ret = spng_get_ihdr(ctx, &source->ihdr);
+    if(!ret) ret = spng_decoded_image_size(ctx, SPNG_FMT_PNG, &source->size);
+    if(!ret)
+    {
+        source->data = malloc(source->size);
+        ret = source->data != NULL ? spng_decode_image(ctx, source->data, source->size, SPNG_FMT_PNG, 0) : SPNG_EMEM;
+    }
+    if(!ret)
+    {
+        source->has_plte = spng_get_plte(ctx, &source->plte) == 0;
+        source->has_trns = spng_get_trns(ctx, &source->trns) == 0;
+    }
+
+    spng_ctx_free(ctx);
+
+    if(ret)
+    {
+        free(source->data);
+        source->data = NULL;
+    }
+    return ret;
+}
+
+/// @brief Encodes an image once with the settings of a grid point
+/// @param output_bytes - set to the size of the PNG
+/// @return - 0 on success, the libspng error otherwise
+static int encode_once(const struct source_image *source, const struct grid_point *point, size_t *output_bytes)
+{
+    spng_ctx *ctx = spng_ctx_new2(&counting_alloc, SPNG_CTX_ENCODER);
+    if(ctx == NULL) return SPNG_EMEM;
+
+    spng_set_option(ctx, SPNG_ENCODE_TO_BUFFER, 1);
+    spng_set_option(ctx, SPNG_IMG_COMPRESSION_LEVEL, point->level);
+    spng_set_option(ctx, SPNG_IMG_WINDOW_BITS, point->window_bits);
+    spng_set_option(ctx, SPNG_IMG_MEM_LEVEL, point->mem_level);
+    spng_set_option(ctx, SPNG_IMG_COMPRESSION_STRATEGY, point->strategy);
+
+    struct spng_ihdr ihdr = source->ihdr;
+    struct spng_plte plte = source->plte;
+    struct spng_trns trns = source->trns;
+
+    int ret = spng_set_ihdr(ctx, &ihdr);
+    if(!ret && source->has_plte) ret = spng_set_plte(ctx, &plte);
+    if(!ret && source->has_trns) ret = spng_set_trns(ctx, &trns);
+    if(!ret) ret = spng_encode_image(ctx, source->data, source->size, SPNG_FMT_PNG, SPNG_ENCODE_FINALIZE);
+
+    if(!ret)
+    {
+        void *png = spng_get_png_buffer(ctx, output_bytes, &ret);
+        counting_free(png);
+    }
+
+    spng_ctx_free(ctx);
+    return ret;
+}
+
+/// @brief Runs every image of the corpus at a grid point
+static void bench_point(const struct source_image *sources, int num_sources, int runs, uint64_t *samples, struct grid_point *point)
+{
+    for(int i = 0; i < num_sources; i++)
+    {
+        size_t output_bytes = 0;
+        int ret = 0;
+
+        live_bytes = 0;
+        peak_bytes = 0;
+
+        for(int run = 0; run < runs && !ret; run++)
+        {
+            uint64_t start = bench_now_ns();
+            ret = encode_once(&sources[i], point, &output_bytes);
+            samples[run] = bench_now_ns() - start;
+        }
+
+        if(ret)
+        {
+            point->errors++;
+            continue;
+        }
+
+        point->encode_ns += bench_percentile(samples, runs, 50);
+        point->output_bytes += output_bytes;
+        if(peak_bytes > point->peak_bytes) point->peak_bytes = peak_bytes;
+    }
+}
+
+/// @brief 1 if a is at least as good as b on time, size and memory and better on one of them
+static int dominates(const struct grid_point *a, const struct grid_point *b)
+{
+    if(a->errors > b->errors) return 0;
+    if(a->encode_ns > b->encode_ns || a->output_bytes > b->output_bytes || a->peak_bytes > b->peak_bytes) return 0;
+
+    return a->encode_ns < b->encode_ns || a->output_bytes < b->output_bytes ||
+           a->peak_bytes < b->peak_bytes || a->errors < b->errors;
+}
+
+static void print_point(const struct grid_point *point, int last)
+{
+    printf("    {\"level\": %d, \"window_bits\": %d, \"mem_level\": %d, \"strategy\": %d, "
+           "\"encode_ns\": %llu, \"output_bytes\": %llu, \"peak_bytes\": %zu, \"errors\": %d}%s\n",
+           point->level, point->window_bits, point->mem_level, point->strategy,
+           (unsigned long long)point->encode_ns, (unsigned long long)point->output_bytes,
+           point->peak_bytes, point->errors, last ? "" : ",");
+}
+
+static int compare_size(const void *a, const void *b)
+{
+    const struct grid_point *x = *(const struct grid_point* const*)a;
+    const struct grid_point *y = *(const struct grid_point* const*)b;
+    return x->output_bytes < y->output_bytes ? -1 : x->output_bytes > y->output_bytes;
+}
+
+int main(int argc, char **argv)
+{
+    int runs = DEFAULT_RUNS;
+    const char *image_dir = "images";
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        if(opt == 'n') runs = atoi(optarg);
+        else
+        {
+            fprintf(stderr, "Usage: %s [-n runs] [image_dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc) image_dir = argv[optind];
+    if(runs < 1) runs = 1;
+
+    struct bench_image *images;
+    int num_images = bench_load_images(image_dir, &images);
+    if(num_images <= 0)
+    {
+        fprintf(stderr, "No images in %s\n", image_dir);
+        return 1;
+    }
+
+    // The images libspng can't decode (the x*.png of PngSuite) are left out
+    struct source_image *sources = (struct source_image*)calloc(num_images, sizeof(struct source_image));
+    int num_sources = 0;
+    for(int i = 0; i < num_images; i++)
+    {
+        if(load_source(&images[i], &sources[num_sources]) == 0) num_sources++;
+    }
+
+    struct grid_point *points = (struct grid_point*)calloc(NUM_POINTS, sizeof(struct grid_point));
+    uint64_t *samples = (uint64_t*)malloc(runs * sizeof(uint64_t));
+    int num_points = 0;
+
+    for(int level = MIN_LEVEL; level <= MAX_LEVEL; level++)
+    for(int window_bits = MIN_WINDOW_BITS; window_bits <= MAX_WINDOW_BITS; window_bits++)
+    for(int mem_level = MIN_MEM_LEVEL; mem_level <= MAX_MEM_LEVEL; mem_level++)
+    for(int strategy = MIN_STRATEGY; strategy <= MAX_STRATEGY; strategy++)
+    {
+        struct grid_point *point = &points[num_points++];
+        point->level = level;
+        point->window_bits = window_bits;
+        point->mem_level = mem_level;
+        point->strategy = strategy;
+
+        fprintf(stderr, "\rEncoding %d images, point %d/%d          ", num_sources, num_points, NUM_POINTS);
+        bench_point(sources, num_sources, runs, samples, point);
+    }
+    fprintf(stderr, "\n");
+
+    printf("{\"benchmark\": \"encode\", \"libspng_version\": ");
+    bench_json_string(spng_version_string());
+    printf(", \"runs\": %d, \"images\": %d,\n  \"points\": [\n", runs, num_sources);
+    for(int i = 0; i < num_points; i++) print_point(&points[i], i + 1 == num_points);
+
+    // Pareto front, from the smallest output to the fastest encode
+    const struct grid_point **front = (const struct grid_point**)malloc(num_points * sizeof(struct grid_point*));
+    int front_size = 0;
+    for(int i = 0; i < num_points; i++)
+    {
+        int dominated = 0;
+        for(int j = 0; j < num_points && !dominated; j++)
+            dominated = dominates(&points[j], &points[i]);
+        if(!dominated) front[front_size++] = &points[i];
+    }
+    qsort(front, front_size, sizeof(front[0]), compare_size);
+
+    printf("  ],\n  \"pareto_front\": [\n");
+    for(int i = 0; i < front_size; i++) print_point(front[i], i + 1 == front_size);
+    printf("  ]\n}\n");
+
+    free(front);
+    free(samples);
+    free(points);
+    for(int i = 0; i < num_sources; i++) free(sources[i].data);
+    free(sources);
+    bench_free_images(images, num_images);
+
+    return 0;
+}
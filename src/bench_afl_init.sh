@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Compares the exec/s of the AFL++ build whose forkserver starts before main()
+# with the build that defers it with __AFL_INIT() until after harness_init().
+# Both runs use the same input directory, duration and afl-fuzz seed.
+# Without afl-fuzz, the gcc builds with the forkserver stand-in of
+# bench/afl_forkserver_emu.h run the input directory in turn instead.
+
+DURATION=${DURATION:-60}  # Seconds per run
+AFL_SEED=${AFL_SEED:-1234}
+
+INPUT_DIR="unique_images"
+if [ ! -d $INPUT_DIR ]; then
+    INPUT_DIR="images"
+fi
+
+BENCH_DIR="./tmp/bench_afl_init"
+
+if command -v afl-fuzz > /dev/null; then
+    PREFIX="afl"
+else
+    echo "afl-fuzz not found, using the forkserver stand-in (bench/afl_forkserver_emu.h)"
+    PREFIX="emu_afl"
+fi
+
+make fuzz/${PREFIX}_nodefer_generic_test_nosan.fuzz fuzz/${PREFIX}_generic_test_nosan.fuzz
+if [ $? -ne 0 ]; then
+    echo "Failed to build the AFL targets"
+    exit 1
+fi
+
+rm -rf $BENCH_DIR
+mkdir -p $BENCH_DIR
+
+# Usage: run_afl <name> <executable>, prints the execs_per_sec of the run
+run_afl() {
+    OUTPUT_DIR="$BENCH_DIR/$1"
+    if [ $PREFIX = "emu_afl" ]; then
+        mkdir -p $OUTPUT_DIR/default
+        AFL_EMU_CASES=$INPUT_DIR AFL_EMU_INPUT=$OUTPUT_DIR/.cur_input AFL_EMU_SECONDS=$DURATION \
+            AFL_EMU_STATS=$OUTPUT_DIR/default/fuzzer_stats $2 $OUTPUT_DIR/.cur_input > $BENCH_DIR/$1.log 2>&1
+        grep "execs_per_sec" $OUTPUT_DIR/default/fuzzer_stats | awk '{print $3}'
+        return
+    fi
+    AFL_NO_UI=1 AFL_SKIP_CPUFREQ=1 AFL_I_DONT_CARE_ABOUT_MISSING_CRASHES=1 \
+        afl-fuzz -V $DURATION -s $AFL_SEED -i $INPUT_DIR/ -o $OUTPUT_DIR/ -- $2 @@ > $BENCH_DIR/$1.log 2>&1
+    grep "execs_per_sec" $OUTPUT_DIR/default/fuzzer_stats | awk '{print $3}'
+}
+
+echo "Running each build for $DURATION s on $INPUT_DIR..."
+NODEFER_EXECS=$(run_afl nodefer ./fuzz/${PREFIX}_nodefer_generic_test_nosan.fuzz)
+DEFER_EXECS=$(run_afl defer ./fuzz/${PREFIX}_generic_test_nosan.fuzz)
+
+if [ -z "$NODEFER_EXECS" ] || [ -z "$DEFER_EXECS" ]; then
+    echo "afl-fuzz failed, see the logs in $BENCH_DIR"
+    exit 1
+fi
+
+echo "Forkserver before main():    $NODEFER_EXECS exec/s"
+echo "Deferred __AFL_INIT():       $DEFER_EXECS exec/s"
+awk -v a=$NODEFER_EXECS -v b=$DEFER_EXECS 'BEGIN { printf "Gain:                        %+.1f%%\n", (b - a) * 100 / a }'
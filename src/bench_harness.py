@@ -0,0 +1,263 @@
+#!/usr/bin/env python3
+"""Exec/s regression benchmark of the generic_test harness builds.
+
+Every built variant (nosan, asan, msan and the AFL++ builds, run outside afl-fuzz)
+executes the same test cases, one process per test case as in run_radamsa.sh. The
+test cases are mutants of the images of a directory drawn from a fixed seed, so two
+runs with the same --cases, --seed and images are comparable.
+
+The time of every execution is split by phase with the HARNESS_PHASE_LOG of the
+harness (PHASE_TIMES in fuzz/generic_test.c), on the same CLOCK_MONOTONIC clock:
+- startup: from the spawn of the process to the test case (exec, dynamic loading,
+  sanitizer runtime and harness_init)
+- load, decode, encode: input_load, fuzz_spng_read and fuzz_spng_write
+- teardown: from the end of the test case to the exit of the process (input release,
+  exit handlers, leak check)
+
+The results are written as JSON and compared to a stored baseline: the script exits
+with status 1 when the exec/s of a variant dropped by more than --threshold percent.
+
+Usage: python3 bench_harness.py [--cases N] [--seed S] [--images DIR] [--variants a,b]
+                                [--baseline FILE] [--update-baseline] [--threshold PCT]
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import time
+
+# Name and executable of every variant, in report order
+VARIANTS = [
+    ("nosan", "fuzz/generic_test.fuzz"),
+    ("asan", "fuzz/generic_test_asan.fuzz"),
+    ("msan", "fuzz/generic_test_msan.fuzz"),
+    ("afl_nosan", "fuzz/afl_generic_test_nosan.fuzz"),
+    ("afl_asan", "fuzz/afl_generic_test_asan.fuzz"),
+    ("afl_msan", "fuzz/afl_generic_test_msan.fuzz"),
+]
+
+PHASES = ["startup", "load", "decode", "encode", "teardown"]
+
+BENCH_DIR = "./tmp/bench_harness"
+
+# Exit code of the sanitizer reports, to tell them apart from the harness result
+SANITIZER_EXITCODE = 86
+
+# Status of the harness watchdog (FORK_STATUS_TIMEOUT)
+TIMEOUT_STATUS = 124
+
+
+def mutate(data, rng):
+    """Applies 1 to 8 byte-level mutations, the PNG signature is kept"""
+    data = bytearray(data)
+    for _ in range(rng.randint(1, 8)):
+        if len(data) <= 8:
+            break
+        op = rng.randrange(4)
+        pos = rng.randrange(8, len(data))
+        if op == 0:
+            data[pos] ^= 1 << rng.randrange(8)
+        elif op == 1:
+            data[pos] = rng.randrange(256)
+        elif op == 2:
+            del data[pos:pos + rng.randint(1, 16)]
+        else:
+            data[pos:pos] = data[pos:pos + rng.randint(1, 16)]
+    return bytes(data)
+
+
+def make_cases(image_dir, case_dir, count, seed):
+    """Writes count mutants of the images of image_dir, returns their paths"""
+    images = sorted(f for f in os.listdir(image_dir) if f.endswith(".png") and not f.startswith("."))
+    if not images:
+        sys.exit("No images in {}".format(image_dir))
+
+    rng = random.Random(seed)
+    paths = []
+    for i in range(count):
+        image = rng.choice(images)
+        with open(os.path.join(image_dir, image), "rb") as f:
+            data = f.read()
+
+        # The harness derives the write configuration from the first 8 characters of the name
+        path = os.path.join(case_dir, "{}_{:05d}.png".format(image[:-4], i))
+        with open(path, "wb") as f:
+            f.write(mutate(data, rng))
+        paths.append(path)
+    return paths
+
+
+def read_phase_log(path):
+    """Parses the HARNESS_PHASE_LOG lines into {case path: (start, load, decode, encode, end)}"""
+    phases = {}
+    if not os.path.exists(path):
+        return phases
+    with open(path) as f:
+        for line in f:
+            fields = line.rstrip("\n").split(" ", 5)
+            if len(fields) == 6:
+                phases[fields[5]] = tuple(int(x) for x in fields[:5])
+    return phases
+
+
+def run_cases(name, executable, cases, timeout, extra_env=None):
+    """Runs every test case in a new process
+
+    Returns the total wall time in ns, the crash and timeout counts, and the phase
+    times in ns of every test case that completed: {case path: {phase: ns}}
+    """
+    log_path = os.path.join(BENCH_DIR, name + "_phases.log")
+    if os.path.exists(log_path):
+        os.remove(log_path)
+
+    env = dict(os.environ)
+    env.update(extra_env or {})
+    env["HARNESS_PHASE_LOG"] = os.path.abspath(log_path)
+    for var in ("ASAN_OPTIONS", "MSAN_OPTIONS"):
+        env[var] = "exitcode={}:{}".format(SANITIZER_EXITCODE, env.get(var, ""))
+
+    def run(case):
+        return subprocess.run([executable, case], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                              env=env, timeout=timeout).returncode
+
+    # Warm-up: page cache of the executable and the libraries
+    run(cases[0])
+    if os.path.exists(log_path):
+        os.remove(log_path)
+
+    spawn = {}
+    exit_ns = {}
+    crashes = timeouts = 0
+    total_ns = 0
+    for i, case in enumerate(cases):
+        print("\r{}: {}/{}".format(name, i + 1, len(cases)), end="", file=sys.stderr, flush=True)
+        start = time.monotonic_ns()
+        try:
+            status = run(case)
+        except subprocess.TimeoutExpired:
+            status = TIMEOUT_STATUS
+        end = time.monotonic_ns()
+        total_ns += end - start
+
+        if status == TIMEOUT_STATUS:
+            timeouts += 1
+        elif status < 0 or status >= 128 or status == SANITIZER_EXITCODE:
+            crashes += 1
+        else:
+            spawn[case] = start
+            exit_ns[case] = end
+    print(file=sys.stderr)
+
+    # Phases of the executions that completed, crashes and timeouts only count in exec/s
+    phases = {}
+    for case, (start, load, decode, encode, end) in read_phase_log(log_path).items():
+        if case in spawn:
+            phases[case] = {"startup": start - spawn[case], "load": load, "decode": decode,
+                            "encode": encode, "teardown": exit_ns[case] - end}
+
+    return total_ns, crashes, timeouts, phases
+
+
+def run_variant(name, executable, cases, timeout):
+    """Runs every test case in a new process, returns the results of the variant"""
+    total_ns, crashes, timeouts, phases = run_cases(name, executable, cases, timeout)
+
+    sums = {p: sum(case[p] for case in phases.values()) for p in PHASES}
+    timed = len(phases)
+    phase_total = sum(sums.values())
+    return {
+        "executable": executable,
+        "cases": len(cases),
+        "crashes": crashes,
+        "timeouts": timeouts,
+        "seconds": total_ns / 1e9,
+        "exec_s": len(cases) / (total_ns / 1e9),
+        "timed_cases": timed,
+        "phases_us": {p: (sums[p] / timed / 1000 if timed else 0) for p in PHASES},
+        "phases_pct": {p: (100.0 * sums[p] / phase_total if phase_total else 0) for p in PHASES},
+    }
+
+
+def compare(results, baseline, threshold):
+    """Prints the change of every variant against the baseline, returns the regressed ones"""
+    regressed = []
+    for name, result in results["variants"].items():
+        base = baseline["variants"].get(name)
+        if base is None:
+            print("{:<10} no baseline".format(name))
+            continue
+
+        change = 100.0 * (result["exec_s"] - base["exec_s"]) / base["exec_s"]
+        phases = ", ".join("{} {:+.0f}us".format(p, result["phases_us"][p] - base["phases_us"][p]) for p in PHASES)
+        failed = change < -threshold
+        if failed:
+            regressed.append(name)
+        print("{:<10} {:8.1f} exec/s vs {:8.1f} ({:+.1f}%){}  [{}]".format(
+            name, result["exec_s"], base["exec_s"], change, "  REGRESSION" if failed else "", phases))
+    return regressed
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Exec/s regression benchmark of the harness builds")
+    parser.add_argument("--cases", type=int, default=500, help="test cases run by every variant")
+    parser.add_argument("--seed", type=int, default=1234, help="seed of the test cases")
+    parser.add_argument("--images", default="images", help="images mutated into the test cases")
+    parser.add_argument("--variants", default=",".join(v[0] for v in VARIANTS), help="comma-separated variants to run")
+    parser.add_argument("--baseline", default="bench/harness_baseline.json", help="stored baseline results")
+    parser.add_argument("--update-baseline", action="store_true", help="store the results as the new baseline")
+    parser.add_argument("--threshold", type=float, default=10.0, help="largest exec/s drop accepted, in percent")
+    parser.add_argument("--timeout", type=float, default=5.0, help="seconds before a process is killed")
+    parser.add_argument("--output", default="bench_harness.json", help="JSON results")
+    args = parser.parse_args()
+
+    case_dir = os.path.join(BENCH_DIR, "cases")
+    shutil.rmtree(BENCH_DIR, ignore_errors=True)
+    os.makedirs(case_dir)
+    cases = make_cases(args.images, case_dir, args.cases, args.seed)
+
+    executables = dict(VARIANTS)
+    results = {"cases": args.cases, "seed": args.seed, "images": args.images, "variants": {}}
+    for name in args.variants.split(","):
+        if name not in executables:
+            sys.exit("Unknown variant {}, expected one of {}".format(name, ", ".join(executables)))
+        if not os.access(executables[name], os.X_OK):
+            print("Skipping {}: {} is not built".format(name, executables[name]), file=sys.stderr)
+            continue
+        results["variants"][name] = run_variant(name, executables[name], cases, args.timeout)
+
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=2)
+
+    print("{:<10} {:>8} {:>7} {:>8}  {}".format("variant", "exec/s", "crashes", "timeouts",
+                                                 "  ".join("{:>14}".format(p + " us") for p in PHASES)))
+    for name, result in results["variants"].items():
+        print("{:<10} {:8.1f} {:7d} {:8d}  {}".format(name, result["exec_s"], result["crashes"], result["timeouts"],
+              "  ".join("{:7.0f} ({:3.0f}%)".format(result["phases_us"][p], result["phases_pct"][p]) for p in PHASES)))
+    print()
+
+    if args.update_baseline or not os.path.exists(args.baseline):
+        with open(args.baseline, "w") as f:
+            json.dump(results, f, indent=2)
+        print("Baseline saved to {}".format(args.baseline))
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    if (baseline["cases"], baseline["seed"], baseline["images"]) != (args.cases, args.seed, args.images):
+        print("The baseline was run with {} cases of {} and seed {}, rerun with them or --update-baseline".format(
+            baseline["cases"], baseline["images"], baseline["seed"]))
+        return 1
+
+    regressed = compare(results, baseline, args.threshold)
+    if regressed:
+        print("Exec/s regression beyond {}% in: {}".format(args.threshold, ", ".join(regressed)))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""Attribution of the sanitizer overhead of the harness.
+
+The profile builds of generic_test (libspng compiled in, CALL_PROFILE in
+fuzz/generic_test.c) run the same test cases as bench_harness.py without
+sanitizer, with ASan and with MSan. Each test case logs the wall time of every
+libspng entry point it called (HARNESS_CALL_LOG) and of its phases
+(HARNESS_PHASE_LOG). Only the test cases that completed under every build are
+aggregated, so the builds are compared on the same work.
+
+For every entry point and phase the report has the time per test case under
+each build, its slowdown against the build without sanitizer, and its share of
+the time the sanitizer adds. "harness code" is the time of load, decode and
+encode spent outside libspng.
+
+Usage: python3 bench_sanitizers.py [--cases N] [--seed S] [--images DIR] [--output FILE]
+"""
+
+import argparse
+import json
+import os
+import shutil
+import sys
+
+from bench_harness import BENCH_DIR, PHASES, make_cases, run_cases
+
+# Name and executable of every build, the first one is the reference
+BUILDS = [
+    ("nosan", "fuzz/profile_generic_test_nosan.fuzz"),
+    ("asan", "fuzz/profile_generic_test_asan.fuzz"),
+    ("msan", "fuzz/profile_generic_test_msan.fuzz"),
+]
+
+
+def read_call_log(path):
+    """Parses the HARNESS_CALL_LOG lines into {case path: {entry point: (calls, ns)}}"""
+    calls = {}
+    if not os.path.exists(path):
+        return calls
+    with open(path) as f:
+        for line in f:
+            fields = line.rstrip("\n").split("\t")
+            entries = {}
+            for field in fields[1:]:
+                name, count, ns = field.rsplit(" ", 2)
+                entries[name] = (int(count), int(ns))
+            calls[fields[0]] = entries
+    return calls
+
+
+def profile_build(name, executable, cases, timeout):
+    """Runs the test cases with a profile build, returns {case path: {row: ns}} and the call counts"""
+    log_path = os.path.join(BENCH_DIR, name + "_calls.log")
+    _, crashes, timeouts, phases = run_cases(name, executable, cases, timeout,
+                                             {"HARNESS_CALL_LOG": os.path.abspath(log_path)})
+    if crashes or timeouts:
+        print("{}: {} crashes, {} timeouts left out".format(name, crashes, timeouts), file=sys.stderr)
+
+    rows = {}
+    counts = {}
+    for case, entries in read_call_log(log_path).items():
+        if case not in phases:
+            continue
+        row = {"phase " + p: ns for p, ns in phases[case].items()}
+        for entry, (calls, ns) in entries.items():
+            row[entry] = ns
+            counts[entry] = counts.get(entry, 0) + calls
+        row["harness code"] = (phases[case]["load"] + phases[case]["decode"] + phases[case]["encode"] -
+                               sum(ns for _, ns in entries.values()))
+        rows[case] = row
+    return rows, counts
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Attribution of the sanitizer overhead of the harness")
+    parser.add_argument("--cases", type=int, default=500, help="test cases run by every build")
+    parser.add_argument("--seed", type=int, default=1234, help="seed of the test cases")
+    parser.add_argument("--images", default="images", help="images mutated into the test cases")
+    parser.add_argument("--timeout", type=float, default=5.0, help="seconds before a process is killed")
+    parser.add_argument("--output", default="bench_sanitizers.json", help="JSON results")
+    args = parser.parse_args()
+
+    case_dir = os.path.join(BENCH_DIR, "cases")
+    shutil.rmtree(BENCH_DIR, ignore_errors=True)
+    os.makedirs(case_dir)
+    cases = make_cases(args.images, case_dir, args.cases, args.seed)
+
+    profiles = {}
+    counts = {}
+    for name, executable in BUILDS:
+        if not os.access(executable, os.X_OK):
+            print("Skipping {}: {} is not built".format(name, executable), file=sys.stderr)
+            continue
+        profiles[name], counts[name] = profile_build(name, executable, cases, args.timeout)
+    if not profiles:
+        sys.exit("No profile build to run")
+
+    # Same test cases for every build: a sanitizer stopping a test case changes its work
+    common = set.intersection(*(set(rows) for rows in profiles.values()))
+    if not common:
+        sys.exit("No test case completed under every build")
+
+    names = sorted({row for rows in profiles.values() for case in common for row in rows[case]})
+    totals = {build: {row: sum(rows[case].get(row, 0) for case in common) for row in names}
+              for build, rows in profiles.items()}
+    wall = {build: sum(totals[build]["phase " + p] for p in PHASES) for build in profiles}
+
+    reference = next(iter(profiles))
+    results = {"cases": args.cases, "seed": args.seed, "images": args.images, "common_cases": len(common),
+               "reference": reference, "builds": {}}
+    for build in profiles:
+        added = wall[build] - wall[reference]
+        rows = {}
+        for row in names:
+            ns = totals[build][row]
+            ref = totals[reference][row]
+            rows[row] = {
+                "us_per_case": ns / len(common) / 1000,
+                "calls": counts[build].get(row, 0),
+                "slowdown": ns / ref if ref > 0 else None,
+                "added_pct": 100.0 * (ns - ref) / added if build != reference and added > 0 else None,
+            }
+        results["builds"][build] = {"us_per_case": wall[build] / len(common) / 1000,
+                                    "slowdown": wall[build] / wall[reference], "rows": rows}
+
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=2)
+
+    # Phases first, then the entry points that take the most added time under the last build
+    last = list(profiles)[-1]
+    phases = ["phase " + p for p in PHASES]
+    entries = sorted((row for row in names if row not in phases), reverse=True,
+                     key=lambda row: totals[last][row] - totals[reference][row])
+
+    print("{} test cases completed under every build".format(len(common)))
+    print("{:<34}".format("us per test case") + "".join("{:>26}".format(build) for build in profiles))
+    print("{:<34}".format("total") + "".join("{:>12.1f} ({:5.2f}x)     ".format(
+        results["builds"][build]["us_per_case"], results["builds"][build]["slowdown"]) for build in profiles))
+    for row in phases + entries:
+        line = "{:<34}".format(row)
+        for build in profiles:
+            r = results["builds"][build]["rows"][row]
+            slowdown = "{:5.2f}x".format(r["slowdown"]) if r["slowdown"] is not None else "    -"
+            added = "{:3.0f}%".format(r["added_pct"]) if r["added_pct"] is not None else "    "
+            line += "{:>12.1f} ({}) {}".format(r["us_per_case"], slowdown, added)
+        print(line)
+    print("\nxN: time against {}, %: share of the time added by the sanitizer".format(reference))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,27 @@
+// Protocol between the fork server of generic_test.c (--server <socket>)
+// and fuzz/forkserver_client.c, over a Unix stream socket:
+// 1. the client connects and sends a struct fork_request followed by the
+//    path of the test case, with its stdout and stderr attached (SCM_RIGHTS)
+// 2. the server forks a child that runs the test case with them as stdout/stderr
+// 3. the server replies with the int32_t status of the child and closes
+#ifndef FORKSERVER_H
+#define FORKSERVER_H
+
+#include <stdint.h>
+
+/// @brief Request sent by the client for every test case
+struct fork_request {
+    uint32_t timeout_ms; // 0 for no timeout
+    uint32_t path_len; // length of the path following the request, without '\0'
+};
+
+// status of a child killed at the timeout (same as timeout(1))
+#define FORK_STATUS_TIMEOUT 124
+
+// status of a child killed by a signal: FORK_STATUS_SIGNAL + signal (as the shell)
+#define FORK_STATUS_SIGNAL 128
+
+// status of a child that exited with FORK_STATUS_TIMEOUT itself: an error, not a timeout
+#define FORK_STATUS_ERROR 1
+
+#endif
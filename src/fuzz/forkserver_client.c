@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "forkserver.h"
+
+// Submits one test case to the fork server of generic_test (--server <socket>)
+// and exits with the status of its execution: the exit code of the test case,
+// 128 + signal if it was killed by a signal, 124 on timeout (the server reports
+// a test case that exited with 124 itself as 1)
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <socket> <test_case> [timeout_ms]\n", argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "Fork server not available on %s\n", argv[1]);
+        return 1;
+    }
+
+    // Sent as an absolute path, the server has its own working directory
+    char path[PATH_MAX];
+    if (realpath(argv[2], path) == NULL)
+    {
+        strncpy(path, argv[2], sizeof(path) - 1);
+        path[sizeof(path) - 1] = '\0';
+    }
+
+    struct fork_request request;
+    request.timeout_ms = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : 0;
+    request.path_len = strlen(path);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &request;
+    iov[0].iov_len = sizeof(request);
+    iov[1].iov_base = path;
+    iov[1].iov_len = request.path_len;
+
+    // stdout and stderr of the test case are the ones of the client
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, 0) != (ssize_t)(sizeof(request) + request.path_len))
+    {
+        fprintf(stderr, "Sending the test case failed\n");
+        close(sock);
+        return 1;
+    }
+
+    // The reply comes once the test case has finished
+    int32_t status;
+    size_t got = 0;
+    while (got < sizeof(status))
+    {
+        ssize_t len = read(sock, (char *)&status + got, sizeof(status) - got);
+        if (len <= 0)
+        {
+            fprintf(stderr, "Fork server closed the connection\n");
+            close(sock);
+            return 1;
+        }
+        got += len;
+    }
+
+    close(sock);
+    return status;
+}
@@ -6,6 +6,44 @@
 #include <spng.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <dirent.h>
+
+#include "forkserver.h"
+
+#ifndef __has_feature
+#define __has_feature(x) 0
+#endif
+
+#if defined(__SANITIZE_ADDRESS__) || __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+#define HARNESS_SANITIZER 1
+#include <sanitizer/common_interface_defs.h>
+#else
+#define HARNESS_SANITIZER 0
+#endif
+
+#if defined(__SANITIZE_ADDRESS__) || __has_feature(address_sanitizer)
+#define HARNESS_ASAN 1
+#include <sanitizer/asan_interface.h>
+#else
+#define HARNESS_ASAN 0
+#define ASAN_POISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#endif
+
+#if __has_feature(memory_sanitizer)
+#define HARNESS_MSAN 1
+#include <sanitizer/msan_interface.h>
+#else
+#define HARNESS_MSAN 0
+#endif
 
 // 0 for always read, 
 // 1 for always write
@@ -16,24 +54,299 @@
 // 1 uses AFL filename parsing function
 #define AFL_MODE 0
 
+// 0 builds the standalone main() that reads the input file from argv
+// 1 builds the in-process libFuzzer entry point LLVMFuzzerTestOneInput (no main)
+#ifndef LIBFUZZER_MODE
+#define LIBFUZZER_MODE 0
+#endif
+
+// 0 builds the standalone main() that reads the input file from argv
+// 1 builds the AFL++ persistent main(): test cases come from shared memory
+//   and many of them are run in the same process with __AFL_LOOP
+#ifndef AFL_PERSISTENT
+#define AFL_PERSISTENT 0
+#endif
+
+// number of test cases run by one persistent process before AFL++ restarts it
+#define AFL_PERSISTENT_ITERATIONS 10000
+
+// 0 starts the AFL++ forkserver before main() (default AFL++ behavior)
+// 1 starts it with __AFL_INIT() after the input-independent setup of harness_init()
+#ifndef AFL_DEFERRED_INIT
+#define AFL_DEFERRED_INIT 1
+#endif
+
+// 0 draws the fuzz_spng_read configuration (stream, fmt, flags, options...) from the PRNG
+// 1 consumes it from the last bytes of the input (FuzzedDataProvider-style), so that
+//   coverage-guided fuzzers can learn and steer it; the bytes before it are the PNG
+#ifndef INPUT_CONFIG
+#define INPUT_CONFIG 0
+#endif
+
+// maximum number of trailing input bytes reserved for the configuration
+#define INPUT_CONFIG_MAX_BYTES 64
+
+// size of the per-execution arena holding the synthetic metadata of write
+#define ARENA_SIZE (64 * 1024)
+
+// bytes left between two arena allocations: under ASan they are poisoned, so an
+// overflow in libspng's copies of the metadata is reported as with malloc
+#ifndef ARENA_REDZONE
+#if HARNESS_ASAN == 1
+#define ARENA_REDZONE 16
+#else
+#define ARENA_REDZONE 0
+#endif
+#endif
+
+// allocator given to libspng with spng_ctx_new2()
+// 0 libspng default allocator (spng_ctx_new)
+// 1 malloc/free, counting the allocations and the peak bytes of every test case
+// 2 size-class pool recycling the freed blocks across test cases (counting too)
+// (not the default under ASan: the pool reuses the last freed block first, without
+// the quarantine of free(), so a use after free would read a live block unreported)
+#ifndef SPNG_ALLOCATOR
+#if (LIBFUZZER_MODE == 1 || AFL_PERSISTENT == 1) && HARNESS_ASAN == 0
+#define SPNG_ALLOCATOR 2
+#else
+#define SPNG_ALLOCATOR 1
+#endif
+#endif
+
+// smallest and largest block recycled by the pool (powers of 2), larger
+// blocks are allocated and freed with malloc/free
+#define POOL_MIN_SHIFT 4
+#define POOL_MAX_SHIFT 20
+
+// largest decoded image allocated by fuzz_spng_read
+#define MAX_DECODE_SIZE 80000000
+
+// 1 decodes into one grow-only output buffer reused by every test case (and by
+//   every configuration of --sweep), the bytes past the current image are poisoned
+//   under ASan (default)
+// 0 allocates and frees the output buffer in every test case
+#ifndef REUSE_DECODE_BUFFER
+#define REUSE_DECODE_BUFFER 1
+#endif
+
+// decode mode of fuzz_spng_read
+// 0 spng_decode_image into the whole image
+// 1 progressive decode, spng_decode_row into the whole image
+// 2 progressive decode, spng_decode_row into a ring buffer of ROW_BUFFER_ROWS rows:
+//   memory only depends on the image width, so images up to the IMAGE_LIMIT
+//   width and height are decoded without the MAX_DECODE_SIZE cap
+// 3 random choice between 0, 1 and 2 (default)
+#ifndef DECODE_MODE
+#define DECODE_MODE 3
+#endif
+
+#define DECODE_ONESHOT 0
+#define DECODE_PROGRESSIVE 1
+#define DECODE_ROWS 2
+
+// rows of the ring buffer of DECODE_ROWS
+#define ROW_BUFFER_ROWS 2
+
+// timeout of every test case run by --batch, in milliseconds
+#define BATCH_TIMEOUT_MS 4000
+
+// largest test case accepted from a --batch stream
+#define BATCH_MAX_CASE_SIZE (64 * 1024 * 1024)
+
 // recommended maximum length for strings in initialization in write
 #define RECOMMENDED_MAX_LENGTH 100
 
 // probability of initializing the fields in write
 #define INITIALIZATION_PROB 1.0
 
+// probability of a fully random (and almost always invalid) IHDR in write,
+// otherwise the IHDR is valid and its image fits in the input bytes
+#define IHDR_INVALID_PROB 0.1
+
+// maximum width and height accepted by the contexts (spng_set_image_limits)
+#define IMAGE_LIMIT 200000
+
+// 1 records the libspng calls, their return codes and the configuration of the
+//   current test case in an in-memory ring buffer, printed to stderr only on a crash
+// 0 disables the ring buffer
+#ifndef CRASH_RING
+#define CRASH_RING 1
+#endif
+
+// number of events kept in the ring buffer (power of 2)
+#define CRASH_RING_SIZE 128
+
+// 0 the harness state (arena, pool, output buffer, crash ring...) is shared by the process
+// 1 every thread has its own copy of it, so that test cases can run in parallel threads
+//   (fuzz/parallel_fuzz.c, which includes this file with GENERIC_TEST_NO_MAIN)
+#ifndef HARNESS_THREADS
+#define HARNESS_THREADS 0
+#endif
+
+#if HARNESS_THREADS == 1
+#define HARNESS_LOCAL _Thread_local
+#else
+#define HARNESS_LOCAL
+#endif
+
+// deadline of every test case in milliseconds, enforced in-process by a timer signal:
+// past it the libspng call in progress and the crash context are printed to stderr
+// and the test case exits with status 124 (FORK_STATUS_TIMEOUT), as with timeout(1)
+// The HARNESS_WATCHDOG_MS environment variable overrides it at run time (0 disables it)
+// 0 compiles the watchdog out (AFL++ builds, whose hangs must reach afl-fuzz -t, libFuzzer
+// builds, which have their own timeout, and the threaded builds: the timer signal is per process)
+#ifndef WATCHDOG_MS
+#if LIBFUZZER_MODE == 1 || AFL_PERSISTENT == 1 || HARNESS_THREADS == 1 || defined(__AFL_COMPILER)
+#define WATCHDOG_MS 0
+#else
+#define WATCHDOG_MS 1000
+#endif
+#endif
+
+// 1 times the phases of the test case run from a file (input load, decode, encode) and
+//   appends them to the file named by the HARNESS_PHASE_LOG environment variable, if set
+//   (see bench_harness.py)
+// 0 disables the timing (libFuzzer, AFL++ persistent and threaded builds, which don't
+//   run their test cases from files)
+#ifndef PHASE_TIMES
+#if LIBFUZZER_MODE == 1 || AFL_PERSISTENT == 1 || HARNESS_THREADS == 1
+#define PHASE_TIMES 0
+#else
+#define PHASE_TIMES 1
+#endif
+#endif
+
+// 1 also sums the wall time of every libspng entry point called by the test case
+//   (spng_decode_image, spng_get_*, spng_ctx_free...) and appends it to the file named
+//   by the HARNESS_CALL_LOG environment variable (profile builds, see bench_sanitizers.py)
+// 0 disables it (default: it reads the clock around every libspng call)
+#ifndef CALL_PROFILE
+#define CALL_PROFILE 0
+#endif
+
+#if CALL_PROFILE == 1 && PHASE_TIMES == 0
+#error "CALL_PROFILE needs PHASE_TIMES"
+#endif
+
+// entry points kept by CALL_PROFILE, the calls past them aren't profiled
+#define CALL_PROFILE_SIZE 128
+
+// Log levels of the harness output, selected at compile time with -DLOG_LEVEL=<level>
+// LOG_SILENT: no output at all, the libspng calls are just run (fuzzing builds)
+// LOG_ERRORS: only the libspng calls that returned an error and the harness errors
+// LOG_TRACE: every libspng call, the configuration and the progress (reproduction builds)
+#define LOG_SILENT 0
+#define LOG_ERRORS 1
+#define LOG_TRACE 2
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_TRACE
+#endif
+
+#if LOG_LEVEL >= LOG_ERRORS
+// set by the sweep mode, which reports one line per configuration instead
+static HARNESS_LOCAL int log_muted = 0;
+#endif
+
+#if LOG_LEVEL >= LOG_TRACE
+#define log_trace(...) do { if (!log_muted) printf(__VA_ARGS__); } while(0)
+#else
+#define log_trace(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_ERRORS
+#define log_error(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define log_error(...) ((void)0)
+#endif
+
+// Times a libspng call under CALL_PROFILE, name is the call as written (see profile_call)
+#if CALL_PROFILE == 1
+#define profile_begin() phase_clock()
+#define profile_end(name, start) profile_call(name, start)
+#else
+#define profile_begin() 0
+#define profile_end(name, start) ((void)(start))
+#endif
+
+// Every libspng call goes through test(), which records it in the crash ring
+// buffer before it runs, so a crash inside the call is shown as in progress
+#if LOG_LEVEL >= LOG_TRACE
 #define test(fn)                                                       \
-    printf("Testing %s... ", #fn);                                     \
-    fflush(stdout);                                                    \
-    fflush(stderr);                                                    \
-    fn_ret = fn;                                                       \
-    if (fn_ret)                                                        \
-        printf("returned %d: %s\n", fn_ret, spng_strerror(fn_ret));    \
-    else printf("OK\n");
+    do {                                                               \
+        unsigned int ring_idx = ring_call_begin(#fn);                  \
+        if (!log_muted) {                                              \
+            printf("Testing %s... ", #fn);                             \
+            fflush(stdout);                                            \
+            fflush(stderr);                                            \
+        }                                                              \
+        uint64_t call_start = profile_begin();                         \
+        fn_ret = fn;                                                   \
+        profile_end(#fn, call_start);                                  \
+        ring_call_end(ring_idx, fn_ret);                               \
+        if (log_muted) break;                                          \
+        if (fn_ret)                                                    \
+            printf("returned %d: %s\n", fn_ret, spng_strerror(fn_ret));\
+        else printf("OK\n");                                           \
+    } while(0)
+#elif LOG_LEVEL >= LOG_ERRORS
+#define test(fn)                                                       \
+    do {                                                               \
+        unsigned int ring_idx = ring_call_begin(#fn);                  \
+        uint64_t call_start = profile_begin();                         \
+        fn_ret = fn;                                                   \
+        profile_end(#fn, call_start);                                  \
+        ring_call_end(ring_idx, fn_ret);                               \
+        if (fn_ret && !log_muted)                                      \
+            printf("Testing %s... returned %d: %s\n",                  \
+                   #fn, fn_ret, spng_strerror(fn_ret));                \
+    } while(0)
+#else
+#define test(fn)                                                       \
+    do {                                                               \
+        unsigned int ring_idx = ring_call_begin(#fn);                  \
+        uint64_t call_start = profile_begin();                         \
+        fn_ret = fn;                                                   \
+        profile_end(#fn, call_start);                                  \
+        ring_call_end(ring_idx, fn_ret);                               \
+    } while(0)
+#endif
+
+// Same as test() for the calls without a return code
+#define test_void(fn)                                                  \
+    do {                                                               \
+        unsigned int ring_idx = ring_call_begin(#fn);                  \
+        log_trace("Testing %s... ", #fn);                              \
+        uint64_t call_start = profile_begin();                         \
+        fn;                                                            \
+        profile_end(#fn, call_start);                                  \
+        ring_call_end(ring_idx, 0);                                    \
+        log_trace("OK\n");                                             \
+    } while(0)
+
+// Prints a configuration value in the trace and records it in the crash ring buffer
+#define log_config(name, value)                                        \
+    do {                                                               \
+        log_trace(" - %s: %d\n", name, (int)(value));                  \
+        ring_config(name, value);                                      \
+    } while(0)
 
 
 // DECLARATION:
-int fuzz_spng_read(const uint8_t* data, size_t size);
+
+/// @brief State of the per-input xoshiro256** generator, every random
+/// decision of a test case is drawn from it (no global rand() state)
+struct fuzz_rng {
+    uint64_t s[4];
+
+    // Input bytes attached with rng_attach_input: while some are left,
+    // draws consume them from the end instead of using the generator
+    const uint8_t *input;
+    size_t input_size;
+    size_t input_left;
+};
+
+int fuzz_spng_read(const uint8_t* data, size_t size, struct fuzz_rng *rng);
 
 enum feature {
     UNKNOWN,
@@ -117,179 +430,1888 @@ typedef struct {
 } PNGConfig;
 
 
-int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config);
+int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config, struct fuzz_rng *rng);
+
+PNGConfig get_PNGConfig(const char *fileName, struct fuzz_rng *rng);
+void get_file_code(const char *path, char *output);
+void get_file_code_afl(const char *path, char *output);
+int fuzz_one_input(const uint8_t *data, size_t size, const char *fileName);
+struct read_config;
+int fuzz_spng_read_config(const uint8_t* data, size_t size, const struct read_config *config, int *error);
+int sweep_spng_read(const uint8_t *data, size_t size);
+void harness_init(void);
+void harness_thread_cleanup(void);
+
+/// @brief Input test case, mapped from the file or read into the heap
+struct input_file {
+    uint8_t *data;
+    size_t size;
+    size_t map_size; // 0 if data was read into the heap
+};
+
+int input_load(int fd, struct input_file *input);
+void input_unload(struct input_file *input);
+int run_input_file(const char *path, int sweep);
+int fork_server(const char *socket_path);
+int batch_executor(const char *source, const char *log_dir);
+void watchdog_input(const char *name, size_t size);
+void watchdog_forked_child(void);
+
+/// @brief Phases of a test case timed with PHASE_TIMES
+enum harness_phase {
+    PHASE_START, // CLOCK_MONOTONIC time when the test case starts, after harness_init
+    PHASE_LOAD, // input file mapped or read
+    PHASE_DECODE, // fuzz_spng_read or sweep_spng_read
+    PHASE_ENCODE, // fuzz_spng_write
+    PHASE_END, // CLOCK_MONOTONIC time when the test case ends, before the input is released
+    PHASE_COUNT
+};
+
+uint64_t phase_clock(void);
+void phase_add(enum harness_phase phase, uint64_t start);
+void phase_mark(enum harness_phase phase);
+void phase_log(const char *path);
+void profile_call(const char *name, uint64_t start);
+void profile_log(const char *path);
+////////////////////////////////////////
+// MAIN:
+////////////////////////////////////////
+
+#if defined(GENERIC_TEST_NO_MAIN)
+
+// The file including this one has its own main() and calls harness_init() and fuzz_one_input()
+
+#elif LIBFUZZER_MODE == 1
+
+/// @brief libFuzzer initialization, called once before the first input
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void)argc;
+    (void)argv;
+    harness_init();
+    return 0;
+}
+
+/// @brief libFuzzer entry point, called once per input inside a single process
+/// @param data - input bytes (owned by libFuzzer)
+/// @param size - size of data
+/// @return - always 0, other values are reserved by libFuzzer
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if(size < 1) return 0;
+
+    // There is no file name to derive the write configuration from,
+    // so the default configuration of get_PNGConfig is used
+    fuzz_one_input(data, size, "");
+
+    return 0;
+}
+
+#elif AFL_PERSISTENT == 1
+
+// Fallback when not compiled with afl-clang-fast: run the test cases read from stdin
+#ifndef __AFL_FUZZ_TESTCASE_LEN
+ssize_t fuzz_len;
+unsigned char fuzz_buf[1024000];
+#define __AFL_FUZZ_TESTCASE_LEN fuzz_len
+#define __AFL_FUZZ_TESTCASE_BUF fuzz_buf
+#define __AFL_FUZZ_INIT() void sync(void)
+#define __AFL_LOOP(x) ((fuzz_len = read(0, fuzz_buf, sizeof(fuzz_buf))) > 0 ? 1 : 0)
+#endif
+
+__AFL_FUZZ_INIT();
+
+int main(void)
+{
+    harness_init();
+
+#if defined(__AFL_HAVE_MANUAL_CONTROL) && AFL_DEFERRED_INIT == 1
+    __AFL_INIT();
+#endif
+
+    // Must be taken after __AFL_INIT and before __AFL_LOOP
+    unsigned char *buf = __AFL_FUZZ_TESTCASE_BUF;
+
+    while(__AFL_LOOP(AFL_PERSISTENT_ITERATIONS))
+    {
+        long siz_buf = __AFL_FUZZ_TESTCASE_LEN;
+        if(siz_buf < 1) continue;
+
+        // The test case lives in shared memory, there is no file name
+        // to derive the write configuration from
+        fuzz_one_input((const uint8_t *)buf, siz_buf, "");
+    }
+
+    return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+    harness_init();
+
+    // --server <socket> forks a child per test case submitted by fuzz/forkserver_client.c
+    if(argc >= 3 && strcmp(argv[1], "--server") == 0)
+    {
+        return fork_server(argv[2]);
+    }
+
+    // Everything above is input-independent, children forked from here start with it done
+#if defined(__AFL_HAVE_MANUAL_CONTROL) && AFL_DEFERRED_INIT == 1
+    __AFL_INIT();
+#endif
+
+    if(argc < 2)
+    {
+        log_error("no input file\n");
+        return 0;
+    }
+
+    // --sweep <file> reads the input with every decode configuration
+    if(argc >= 3 && strcmp(argv[1], "--sweep") == 0)
+    {
+        return run_input_file(argv[2], 1);
+    }
+
+    // --batch <dir|list|-> [log_dir] runs many test cases, one forked child each
+    if(argc >= 3 && strcmp(argv[1], "--batch") == 0)
+    {
+        return batch_executor(argv[2], argc >= 4 ? argv[3] : NULL);
+    }
+
+    return run_input_file(argv[1], 0);
+}
+
+#endif
+
+//////////////////////////
+// DEFINITIONS:
+//////////////////////////
+
+/////////////////////////////////////////////
+// INPUT FILE:
+/////////////////////////////////////////////
+
+/// @brief Runs the test case in a file, as main() does for its argument
+/// @param path - path of the test case
+/// @param sweep - 1 to read it with every decode configuration (sweep_spng_read)
+/// @return - result of the test case, 0 if the file can't be read
+int run_input_file(const char *path, int sweep)
+{
+    struct input_file input = {NULL, 0, 0};
+    int success = 0;
+
+    phase_mark(PHASE_START);
+
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+    {
+        log_error("error opening input file %s\n", path);
+        return 0;
+    }
+
+    // map or read the whole file
+    uint64_t phase_start = phase_clock();
+    if(input_load(fd, &input))
+    {
+        log_error("error reading input file %s\n", path);
+        goto error;
+    }
+    phase_add(PHASE_LOAD, phase_start);
+
+    if(input.size < 1) {
+        log_error("file is empty\n");
+        goto error;
+    }
+
+    if(sweep)
+    {
+        phase_start = phase_clock();
+        success = sweep_spng_read(input.data, input.size);
+        phase_add(PHASE_DECODE, phase_start);
+    }
+    else
+    {
+        char fileName[256];
+
+#if AFL_MODE == 1
+        get_file_code_afl(path, fileName);
+#else
+        get_file_code(path, fileName);
+#endif
+        log_trace("File name: %s\n", fileName);
+
+        watchdog_input(path, input.size);
+        success = fuzz_one_input(input.data, input.size, fileName);
+    }
+
+error:
+    phase_mark(PHASE_END);
+    phase_log(path);
+    profile_log(path);
+
+    input_unload(&input);
+    close(fd);
+
+    return success;
+}
+
+/////////////////////////////////////////////
+// FORK SERVER:
+/////////////////////////////////////////////
+
+/// @brief Reads exactly size bytes from a socket
+/// @return - 0 on success, -1 on error or end of file
+static int read_full(int fd, void *buf, size_t size)
+{
+    size_t got = 0;
+    while(got < size)
+    {
+        ssize_t n = read(fd, (char*)buf + got, size - got);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+/// @brief Receives a request, the path of the test case and the stdout/stderr
+/// of the client (fork_request protocol in forkserver.h)
+/// @return - 0 on success, -1 on error
+/// @brief Closes every descriptor passed in the control messages of a rejected request
+static void close_received_fds(struct msghdr *msg)
+{
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(size_t i = 0; i < count; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            close(fd);
+        }
+    }
+}
+
+static int receive_request(int conn, struct fork_request *request, char *path, size_t path_size, int fds[2])
+{
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct iovec iov = {request, sizeof(*request)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(conn, &msg, MSG_WAITALL);
+    if(n < 0) return -1;
+
+    // Descriptors that arrived with a malformed request are not kept open
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(n != (ssize_t)sizeof(*request) || (msg.msg_flags & MSG_CTRUNC) || cmsg == NULL ||
+       cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+       cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+    {
+        close_received_fds(&msg);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+    if(request->path_len >= path_size || read_full(conn, path, request->path_len))
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    path[request->path_len] = '\0';
+
+    return 0;
+}
+
+/// @brief Waits for a child, killing it at the timeout
+/// @param pid - child
+/// @param timeout_ms - timeout, 0 for none
+/// @param sigchld - set with only SIGCHLD, blocked in the server
+/// @return - exit code of the child (FORK_STATUS_ERROR for an exit code of FORK_STATUS_TIMEOUT),
+/// FORK_STATUS_SIGNAL + signal if it was killed by a signal, FORK_STATUS_TIMEOUT if it
+/// was killed at the timeout or stopped by its watchdog (SIGALRM)
+static int wait_child(pid_t pid, uint32_t timeout_ms, const sigset_t *sigchld)
+{
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000; }
+
+    int status;
+    int timed_out = 0;
+
+    for(;;)
+    {
+        pid_t ret = waitpid(pid, &status, timed_out ? 0 : WNOHANG);
+        if(ret == pid) break;
+        if(ret < 0 && errno != EINTR) return FORK_STATUS_SIGNAL + SIGKILL;
+        if(ret != 0) continue;
+
+        if(timeout_ms == 0)
+        {
+            sigwaitinfo(sigchld, NULL);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec left = {deadline.tv_sec - now.tv_sec, deadline.tv_nsec - now.tv_nsec};
+        if(left.tv_nsec < 0) { left.tv_sec--; left.tv_nsec += 1000000000; }
+
+        if(left.tv_sec < 0)
+        {
+            kill(pid, SIGKILL);
+            timed_out = 1;
+            continue;
+        }
+
+        // A SIGCHLD left pending by an earlier child only costs one more waitpid()
+        sigtimedwait(sigchld, NULL, &left);
+    }
+
+    // Only the timeout of the parent and the watchdog of the child are timeouts,
+    // a test case exiting with the timeout status on its own is an error
+    if(timed_out) return FORK_STATUS_TIMEOUT;
+    if(WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) return FORK_STATUS_TIMEOUT;
+    if(WIFSIGNALED(status)) return FORK_STATUS_SIGNAL + WTERMSIG(status);
+    if(WEXITSTATUS(status) == FORK_STATUS_TIMEOUT) return FORK_STATUS_ERROR;
+    return WEXITSTATUS(status);
+}
+
+/// @brief Fork server: after the setup of harness_init, forks a child per test case
+/// received on a Unix socket, so no exec(), dynamic loading or libspng relocation
+/// is paid per test case. Test cases are run one at a time.
+/// @param socket_path - path of the Unix socket to listen on
+/// @return - 1 if the server can't start (it never returns otherwise)
+int fork_server(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        log_error("socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if(sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0)
+    {
+        log_error("can't listen on %s\n", socket_path);
+        return 1;
+    }
+
+    // SIGCHLD is only waited for, the children get it back unblocked
+    sigset_t sigchld, old_mask;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, &old_mask);
+
+    // A client gone before the reply must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Fork server listening on %s\n", socket_path);
+
+    for(;;)
+    {
+        int conn = accept(sock, NULL, NULL);
+        if(conn < 0) continue;
+
+        struct fork_request request;
+        char path[4096];
+        int fds[2];
+
+        if(receive_request(conn, &request, path, sizeof(path), fds))
+        {
+            close(conn);
+            continue;
+        }
+
+        // Anything buffered now would be written again by the child
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            close(sock);
+            close(conn);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            signal(SIGPIPE, SIG_DFL);
+
+            dup2(fds[0], STDOUT_FILENO);
+            dup2(fds[1], STDERR_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            watchdog_forked_child();
+
+            // exit() flushes the output of the test case
+            exit(run_input_file(path, 0));
+        }
+
+        close(fds[0]);
+        close(fds[1]);
+
+        int32_t status = pid < 0 ? 1 : wait_child(pid, request.timeout_ms, &sigchld);
+        if(write(conn, &status, sizeof(status)) != sizeof(status))
+            log_error("can't reply to the fork server client\n");
+        close(conn);
+    }
+}
+
+/////////////////////////////////////////////
+// BATCH EXECUTOR:
+/////////////////////////////////////////////
+
+/// @brief State shared by the test cases of a batch
+struct batch_state {
+    sigset_t sigchld; // only SIGCHLD, blocked in the batch process
+    sigset_t old_mask; // signal mask given back to the children
+    int out_fd; // stdout and stderr of the children
+    const char *log_dir; // where the output of the failing test cases is kept, or NULL
+    int total;
+    int crashes;
+    int timeouts;
+    int errors;
+};
+
+/// @brief Copies the output of the last test case to <log_dir>/<index>.log
+static void batch_save_log(struct batch_state *batch, int index)
+{
+    char log_path[4096];
+    snprintf(log_path, sizeof(log_path), "%s/%d.log", batch->log_dir, index);
+
+    int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(log_fd < 0) return;
+
+    char buf[64 * 1024];
+    ssize_t n;
+    lseek(batch->out_fd, 0, SEEK_SET);
+    while((n = read(batch->out_fd, buf, sizeof(buf))) > 0)
+    {
+        if(write(log_fd, buf, n) != n) break;
+    }
+    close(log_fd);
+}
+
+/// @brief Runs one test case in a forked child and writes its record:
+/// "<index> <status> <name>", status as in forkserver.h
+/// @param path - file of the test case, NULL if it is in data
+static void batch_run_case(struct batch_state *batch, const char *name, const char *path, const uint8_t *data, size_t size)
+{
+    int index = batch->total++;
+
+    if(batch->log_dir != NULL)
+    {
+        if(ftruncate(batch->out_fd, 0)) log_error("can't truncate the test case output\n");
+        lseek(batch->out_fd, 0, SEEK_SET);
+    }
+
+    // Anything buffered now would be written again by the child
+    fflush(stdout);
+    fflush(stderr);
+
+    int status = 1;
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        sigprocmask(SIG_SETMASK, &batch->old_mask, NULL);
+        dup2(batch->out_fd, STDOUT_FILENO);
+        dup2(batch->out_fd, STDERR_FILENO);
+
+        watchdog_forked_child();
+        watchdog_input(name, size);
+        int ret = path != NULL ? run_input_file(path, 0) : fuzz_one_input(data, size, "");
+
+        // _exit(): exit() would also sync the offset of the shared file list
+        fflush(stdout);
+        fflush(stderr);
+        _exit(ret);
+    }
+    if(pid > 0) status = wait_child(pid, BATCH_TIMEOUT_MS, &batch->sigchld);
+
+    if(status == FORK_STATUS_TIMEOUT) batch->timeouts++;
+    else if(status > FORK_STATUS_SIGNAL) batch->crashes++;
+    else if(status != 0) batch->errors++;
+
+    if(status != 0 && batch->log_dir != NULL) batch_save_log(batch, index);
+
+    printf("%d %d %s\n", index, status, name);
+}
+
+/// @brief Runs the length-prefixed test cases of stdin: every test case is
+/// a 4-byte little-endian length followed by that many bytes
+static void batch_run_stream(struct batch_state *batch)
+{
+    uint8_t *buf = NULL;
+    size_t capacity = 0;
+    char name[32];
+
+    for(;;)
+    {
+        uint8_t header[4];
+        if(read_full(STDIN_FILENO, header, sizeof(header))) break;
+
+        size_t size = (size_t)header[0] | (size_t)header[1] << 8 | (size_t)header[2] << 16 | (size_t)header[3] << 24;
+        if(size > BATCH_MAX_CASE_SIZE)
+        {
+            log_error("test case of %zu bytes in the batch stream, stopping\n", size);
+            break;
+        }
+
+        if(size > capacity)
+        {
+            uint8_t *new_buf = (uint8_t*)realloc(buf, size);
+            if(new_buf == NULL) break;
+            buf = new_buf;
+            capacity = size;
+        }
+        if(size > 0 && read_full(STDIN_FILENO, buf, size))
+        {
+            log_error("truncated test case in the batch stream\n");
+            break;
+        }
+
+        snprintf(name, sizeof(name), "stdin:%d", batch->total);
+
+        // Empty test cases are recorded, there is nothing to run
+        if(size == 0) printf("%d 0 %s\n", batch->total++, name);
+        else batch_run_case(batch, name, NULL, buf, size);
+    }
+
+    free(buf);
+}
+
+/// @brief Runs the files of a directory, in name order (hidden files excluded)
+static void batch_run_dir(struct batch_state *batch, const char *dir)
+{
+    struct dirent **entries;
+    int n = scandir(dir, &entries, NULL, alphasort);
+    if(n < 0)
+    {
+        log_error("can't read directory %s\n", dir);
+        return;
+    }
+
+    char path[4096];
+    for(int i = 0; i < n; i++)
+    {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+        if(entries[i]->d_name[0] != '.' && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            batch_run_case(batch, path, path, NULL, 0);
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+/// @brief Runs the files listed in a file, one path per line
+static void batch_run_list(struct batch_state *batch, const char *list_path)
+{
+    FILE *list = fopen(list_path, "r");
+    if(list == NULL)
+    {
+        log_error("can't open file list %s\n", list_path);
+        return;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while((len = getline(&line, &line_size, list)) != -1)
+    {
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        if(len > 0) batch_run_case(batch, line, line, NULL, 0);
+    }
+
+    free(line);
+    fclose(list);
+}
+
+/// @brief Batch executor: runs many test cases in one process, after the setup of
+/// harness_init, each in a forked child so that a crash only ends its test case.
+/// One record per test case is written to stdout: "<index> <status> <name>", the
+/// status being the exit code, 128 + signal on a crash or 124 on timeout
+/// @param source - directory, file with one path per line, or "-" for a stream of
+/// length-prefixed test cases on stdin
+/// @param log_dir - directory where the output of the failing test cases is kept
+/// as <index>.log, NULL to discard it
+/// @return - 1 if any test case failed, 0 otherwise
+int batch_executor(const char *source, const char *log_dir)
+{
+    struct batch_state batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.log_dir = log_dir;
+
+    if(log_dir != NULL)
+    {
+        FILE *out = tmpfile();
+        batch.out_fd = out != NULL ? dup(fileno(out)) : -1;
+        if(out != NULL) fclose(out);
+    }
+    else
+    {
+        batch.out_fd = open("/dev/null", O_WRONLY);
+    }
+    if(batch.out_fd < 0)
+    {
+        log_error("can't open the test case output\n");
+        return 1;
+    }
+
+    // SIGCHLD is only waited for, the children get it back unblocked
+    sigemptyset(&batch.sigchld);
+    sigaddset(&batch.sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &batch.sigchld, &batch.old_mask);
+
+    struct stat st;
+    if(strcmp(source, "-") == 0) batch_run_stream(&batch);
+    else if(stat(source, &st) == 0 && S_ISDIR(st.st_mode)) batch_run_dir(&batch, source);
+    else batch_run_list(&batch, source);
+
+    sigprocmask(SIG_SETMASK, &batch.old_mask, NULL);
+    close(batch.out_fd);
+
+    fflush(stdout);
+    fprintf(stderr, "Batch: %d test cases, %d crashes, %d timeouts, %d errors\n",
+            batch.total, batch.crashes, batch.timeouts, batch.errors);
+
+    return batch.crashes + batch.timeouts + batch.errors > 0;
+}
+
+/////////////////////////////////////////////
+// INPUT LOADING:
+/////////////////////////////////////////////
+
+/// @brief Loads the whole input: regular files are mapped and given to libspng
+/// as they are, anything else (pipes, devices) is read until EOF
+/// @param fd - input file descriptor
+/// @param input - filled with the input bytes, released with input_unload
+/// @return - 0 on success, -1 on error
+int input_load(int fd, struct input_file *input)
+{
+    struct stat st;
+
+    input->data = NULL;
+    input->size = 0;
+    input->map_size = 0;
+
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t size = (size_t)st.st_size;
+        size_t map_size = ((size + page - 1) & ~(page - 1)) + page;
+
+        // One more inaccessible page is reserved after the input, so an
+        // overread past the end of the mapping faults instead of going unnoticed
+        uint8_t *area = (uint8_t*)mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(area != MAP_FAILED)
+        {
+            if(mmap(area, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED)
+            {
+                // libspng reads it start to end right away
+                madvise(area, size, MADV_WILLNEED);
+
+                // The rest of the last page reads as zeros, under ASan it is an overflow
+                ASAN_POISON_MEMORY_REGION(area + size, map_size - page - size);
+
+                input->data = area;
+                input->size = size;
+                input->map_size = map_size;
+                return 0;
+            }
+            munmap(area, map_size);
+        }
+    }
+
+    // read() may return fewer bytes than asked (pipes, signals), loop until EOF
+    size_t capacity = 0;
+    uint8_t *buf = NULL;
+
+    for(;;)
+    {
+        if(input->size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64 * 1024;
+            uint8_t *new_buf = (uint8_t*)realloc(buf, capacity);
+            if(new_buf == NULL) goto error;
+            buf = new_buf;
+        }
+
+        ssize_t n = read(fd, buf + input->size, capacity - input->size);
+        if(n == 0) break;
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            goto error;
+        }
+        input->size += (size_t)n;
+    }
+
+    // Shrinking to the input size keeps the ASan redzone right after it
+    if(input->size > 0)
+    {
+        uint8_t *new_buf = (uint8_t*)realloc(buf, input->size);
+        if(new_buf != NULL) buf = new_buf;
+    }
+
+    input->data = buf;
+    return 0;
+
+error:
+    free(buf);
+    input->size = 0;
+    return -1;
+}
+
+/// @brief Releases an input loaded with input_load
+void input_unload(struct input_file *input)
+{
+    if(input->map_size != 0)
+    {
+        // The shadow memory outlives the mapping, a later one must not see the poison
+        ASAN_UNPOISON_MEMORY_REGION(input->data, input->map_size);
+        munmap(input->data, input->map_size);
+    }
+    else
+    {
+        free(input->data);
+    }
+
+    input->data = NULL;
+    input->size = 0;
+    input->map_size = 0;
+}
+
+// FUNCTIONS TAKEN FROM spng.c
+
+/// @brief Struct to store buffer state
+struct buf_state
+{
+    const uint8_t *data;
+    size_t bytes_left;
+};
+
+/// @brief Read function for spng_set_png_stream
+/// @param ctx - spng context
+/// @param user - user data
+/// @param dest - destination buffer
+/// @param length - length of data to read
+/// @return - 0 on success, SPNG_IO_EOF on failure
+static int buffer_read_fn(spng_ctx *ctx, void *user, void *dest, size_t length)
+{
+    struct buf_state *state = (struct buf_state*)user;
+    (void)ctx;
+
+    if(length > state->bytes_left) return SPNG_IO_EOF;
+
+    memcpy(dest, state->data, length);
+
+    state->bytes_left -= length;
+    state->data += length;
+
+    return 0;
+}
+
+/// @brief Write function for spng_set_png_stream
+/// @param ctx - spng context
+/// @param user - user data
+/// @param data - data to write
+/// @param length - length of data to write
+/// @return - 0 on success, SPNG_IO_EOF on failure
+static int stream_write_fn(spng_ctx *ctx, void *user, void *data, size_t length)
+{
+    struct buf_state *state = (struct buf_state*)user;
+    (void)ctx;
+
+    if(length > state->bytes_left) return SPNG_IO_EOF;
+
+    state->bytes_left -= length;
+
+    if(state->data)
+    {
+        memcpy(data, state->data, length);
+        state->data += length;
+    }
+
+    return 0;
+}
+
+// end spng.c
+
+/////////////////////////////////////////////
+// CRASH CONTEXT RING BUFFER:
+/////////////////////////////////////////////
+
+#if (CRASH_RING == 1 && LIBFUZZER_MODE == 0) || WATCHDOG_MS > 0
+
+// Async-signal-safe output to stderr, for the crash and watchdog handlers
+
+static void ring_write_str(const char *str)
+{
+    if(write(STDERR_FILENO, str, strlen(str)) < 0) return;
+}
+
+static void ring_write_int(int value)
+{
+    char buf[16];
+    char *p = buf + sizeof(buf);
+    unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+    *--p = '\0';
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while(u);
+    if(value < 0) *--p = '-';
+
+    ring_write_str(p);
+}
+
+#endif
+
+#if CRASH_RING == 1
+
+enum ring_kind {
+    RING_MARK,   // progress marker
+    RING_CONFIG, // configuration value
+    RING_CALL    // libspng call and its return code
+};
+
+/// @brief Event of the current test case, names are string literals
+/// so recording an event never copies or formats anything
+struct ring_entry {
+    enum ring_kind kind;
+    const char *name;
+    int value;
+    int done;   // 0 while a call is still in progress
+};
+
+static HARNESS_LOCAL struct ring_entry crash_ring[CRASH_RING_SIZE];
+static HARNESS_LOCAL unsigned int crash_ring_head = 0;
+
+/// @brief Records an event in the ring buffer, overwriting the oldest one when full
+/// @return - index of the event, to be passed to ring_call_end
+static inline unsigned int ring_record(enum ring_kind kind, const char *name, int value, int done)
+{
+    unsigned int idx = crash_ring_head++;
+    struct ring_entry *entry = &crash_ring[idx % CRASH_RING_SIZE];
+
+    entry->kind = kind;
+    entry->name = name;
+    entry->value = value;
+    entry->done = done;
+
+    return idx;
+}
+
+/// @brief Stores the return code of a call recorded with ring_call_begin
+static inline void ring_call_end(unsigned int idx, int ret)
+{
+    struct ring_entry *entry = &crash_ring[idx % CRASH_RING_SIZE];
+
+    // The event was overwritten by the calls made in between (e.g. row loops)
+    if(entry->kind != RING_CALL || idx + CRASH_RING_SIZE <= crash_ring_head) return;
+
+    entry->value = ret;
+    entry->done = 1;
+}
+
+#define ring_reset() (crash_ring_head = 0)
+#define ring_mark(name) ring_record(RING_MARK, name, 0, 1)
+#define ring_config(name, value) ring_record(RING_CONFIG, name, (int)(value), 1)
+#define ring_call_begin(name) ring_record(RING_CALL, name, 0, 0)
+
+#if WATCHDOG_MS > 0
+/// @brief Name of the innermost libspng call still in progress, NULL if there is none
+static const char *ring_in_progress(void)
+{
+    unsigned int head = crash_ring_head;
+    unsigned int count = head < CRASH_RING_SIZE ? head : CRASH_RING_SIZE;
+
+    for(unsigned int i = head; i != head - count; i--)
+    {
+        const struct ring_entry *entry = &crash_ring[(i - 1) % CRASH_RING_SIZE];
+        if(entry->kind == RING_CALL && !entry->done) return entry->name;
+    }
+    return NULL;
+}
+#endif
+
+// libFuzzer has its own crash handling and death callback: the dump is only
+// left for the watchdog there
+#if LIBFUZZER_MODE == 0 || WATCHDOG_MS > 0
+
+// Only async-signal-safe functions from here: the dump runs in the crash handlers
+
+/// @brief Prints the events of the current test case to stderr, oldest first
+static void crash_ring_dump(void)
+{
+    unsigned int head = crash_ring_head;
+    unsigned int count = head < CRASH_RING_SIZE ? head : CRASH_RING_SIZE;
+
+    ring_write_str("\n==== Crash context: last ");
+    ring_write_int((int)count);
+    ring_write_str(" events of the test case ====\n");
+
+    for(unsigned int i = head - count; i != head; i++)
+    {
+        const struct ring_entry *entry = &crash_ring[i % CRASH_RING_SIZE];
+
+        switch(entry->kind)
+        {
+        case RING_MARK:
+            ring_write_str(entry->name);
+            ring_write_str("\n");
+            break;
+        case RING_CONFIG:
+            ring_write_str(" - ");
+            ring_write_str(entry->name);
+            ring_write_str(": ");
+            ring_write_int(entry->value);
+            ring_write_str("\n");
+            break;
+        case RING_CALL:
+            ring_write_str("Testing ");
+            ring_write_str(entry->name);
+            if(!entry->done) ring_write_str("... IN PROGRESS\n");
+            else if(entry->value == 0) ring_write_str("... OK\n");
+            else {
+                ring_write_str("... returned ");
+                ring_write_int(entry->value);
+                ring_write_str("\n");
+            }
+            break;
+        }
+    }
+
+    ring_write_str("==== End of crash context ====\n");
+}
+
+#if LIBFUZZER_MODE == 0
+#if HARNESS_SANITIZER == 0
+static void crash_signal_handler(int sig)
+{
+    crash_ring_dump();
+
+    // SA_RESETHAND restored the default action, so the process still dies
+    // with the same signal (and exit status) as without the handler
+    raise(sig);
+}
+#endif
+
+/// @brief Installs the dump of the ring buffer on crash: the death callback
+/// under ASan/MSan (their reports come first), signal handlers otherwise
+static void crash_ring_install(void)
+{
+#if HARNESS_SANITIZER == 1
+    __sanitizer_set_death_callback(crash_ring_dump);
+#else
+    static char alt_stack[64 * 1024];
+    stack_t ss;
+    ss.ss_sp = alt_stack;
+    ss.ss_size = sizeof(alt_stack);
+    ss.ss_flags = 0;
+    sigaltstack(&ss, NULL);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = crash_signal_handler;
+    sa.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+
+    int signals[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL};
+    for(size_t i = 0; i < sizeof(signals) / sizeof(int); i++)
+        sigaction(signals[i], &sa, NULL);
+#endif
+}
+#endif
+#endif
+
+#else
+
+#define ring_reset() ((void)0)
+#define ring_mark(name) ((void)0)
+#define ring_config(name, value) ((void)0)
+#define ring_call_begin(name) 0u
+#define ring_call_end(idx, ret) ((void)(idx), (void)(ret))
+#define ring_in_progress() ((const char*)NULL)
+
+#endif
+
+/////////////////////////////////////////////
+// WATCHDOG:
+/////////////////////////////////////////////
+
+#if WATCHDOG_MS > 0
+
+// deadline of the test cases, WATCHDOG_MS or HARNESS_WATCHDOG_MS
+static long watchdog_ms = WATCHDOG_MS;
+
+// name and size of the test case, for the hang report
+static const char *watchdog_input_name = "";
+static size_t watchdog_input_size = 0;
+
+// set in the children of the fork server and of the batch mode, stopped with SIGALRM
+// instead of the timeout status: their parent can't tell that from an exit code
+static int watchdog_raise = 0;
+
+/// @brief Stops a test case past its deadline: reports the call it was stuck in,
+/// and exits with the timeout status, so hangs are told apart from crashes
+static void watchdog_handler(int sig)
+{
+    (void)sig;
+    const char *call = ring_in_progress();
+
+    ring_write_str("\n==== Hang: test case stopped after ");
+    ring_write_int((int)watchdog_ms);
+    ring_write_str(" ms ====\nInput: ");
+    ring_write_str(watchdog_input_name);
+    ring_write_str(" (");
+    ring_write_int((int)watchdog_input_size);
+    ring_write_str(" bytes)\nIn progress: ");
+    ring_write_str(call != NULL ? call : "unknown");
+    ring_write_str("\n");
+
+#if CRASH_RING == 1
+    crash_ring_dump();
+#endif
+
+    if(watchdog_raise)
+    {
+        // Default action and unblocked: the process dies of SIGALRM here
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_DFL;
+        sigaction(SIGALRM, &sa, NULL);
+
+        sigset_t alarm_set;
+        sigemptyset(&alarm_set);
+        sigaddset(&alarm_set, SIGALRM);
+        sigprocmask(SIG_UNBLOCK, &alarm_set, NULL);
+        raise(SIGALRM);
+    }
+
+    _exit(FORK_STATUS_TIMEOUT);
+}
+
+/// @brief Reads the deadline from HARNESS_WATCHDOG_MS and installs the timer signal handler
+static void watchdog_install(void)
+{
+    const char *env = getenv("HARNESS_WATCHDOG_MS");
+    if(env != NULL && env[0] != '\0')
+    {
+        char *end;
+        long ms = strtol(env, &end, 10);
+        if(*end == '\0' && ms >= 0) watchdog_ms = ms;
+        else log_error("invalid HARNESS_WATCHDOG_MS %s, using %d ms\n", env, WATCHDOG_MS);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watchdog_handler;
+    sa.sa_flags = SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+}
+
+/// @brief Starts (ms > 0) or stops (ms == 0) the deadline of the current test case
+static void watchdog_set(long ms)
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = ms / 1000;
+    timer.it_value.tv_usec = (ms % 1000) * 1000;
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+#define watchdog_arm() do { if(watchdog_ms > 0) watchdog_set(watchdog_ms); } while(0)
+#define watchdog_disarm() watchdog_set(0)
+
+#else
+
+#define watchdog_arm() ((void)0)
+#define watchdog_disarm() ((void)0)
+
+#endif
+
+/// @brief Names the next test case in the hang report of the watchdog
+void watchdog_input(const char *name, size_t size)
+{
+#if WATCHDOG_MS > 0
+    watchdog_input_name = name;
+    watchdog_input_size = size;
+#else
+    (void)name;
+    (void)size;
+#endif
+}
+
+/// @brief Makes the watchdog of a forked child die of SIGALRM, which wait_child
+/// counts as a timeout, instead of exiting with the timeout status
+void watchdog_forked_child(void)
+{
+#if WATCHDOG_MS > 0
+    watchdog_raise = 1;
+#endif
+}
+
+/////////////////////////////////////////////
+// PHASE TIMES AND CALL PROFILE:
+/////////////////////////////////////////////
+
+#if PHASE_TIMES == 1
+// absolute times (PHASE_START, PHASE_END) and durations of the test case, in ns
+static uint64_t phase_ns[PHASE_COUNT];
+#endif
+
+/// @brief CLOCK_MONOTONIC time in ns, the clock of bench_harness.py (0 without PHASE_TIMES)
+uint64_t phase_clock(void)
+{
+#if PHASE_TIMES == 1
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/// @brief Adds the time since start (from phase_clock) to a phase
+void phase_add(enum harness_phase phase, uint64_t start)
+{
+#if PHASE_TIMES == 1
+    phase_ns[phase] += phase_clock() - start;
+#else
+    (void)phase;
+    (void)start;
+#endif
+}
+
+/// @brief Records the current time as the absolute time of a phase
+void phase_mark(enum harness_phase phase)
+{
+#if PHASE_TIMES == 1
+    phase_ns[phase] = phase_clock();
+#else
+    (void)phase;
+#endif
+}
+
+/// @brief Appends "<start> <load> <decode> <encode> <end> <path>" to the file named by
+/// HARNESS_PHASE_LOG, one write per test case so that concurrent runs don't interleave
+void phase_log(const char *path)
+{
+#if PHASE_TIMES == 1
+    const char *log_path = getenv("HARNESS_PHASE_LOG");
+    if(log_path == NULL || log_path[0] == '\0') return;
+
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd == -1) return;
+
+    char line[4096 + 128];
+    int len = snprintf(line, sizeof(line), "%llu %llu %llu %llu %llu %s\n",
+                       (unsigned long long)phase_ns[PHASE_START], (unsigned long long)phase_ns[PHASE_LOAD],
+                       (unsigned long long)phase_ns[PHASE_DECODE], (unsigned long long)phase_ns[PHASE_ENCODE],
+                       (unsigned long long)phase_ns[PHASE_END], path);
+    if(len > 0 && (size_t)len < sizeof(line) && write(fd, line, len) < 0)
+    {
+        log_error("error writing %s\n", log_path);
+    }
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+#if CALL_PROFILE == 1
+/// @brief Calls and wall time of a libspng entry point over the test case
+struct call_profile {
+    const char *name; // call as written in the harness, the entry point is the part before '('
+    size_t name_len;
+    uint64_t calls;
+    uint64_t ns;
+};
+
+static struct call_profile call_profile[CALL_PROFILE_SIZE];
+static size_t call_profile_count = 0;
+#endif
+
+/// @brief Adds a call started at start (from phase_clock) to its entry point
+/// @param name - call as written, "spng_get_ihdr(ctx, &ihdr)" counts for spng_get_ihdr
+void profile_call(const char *name, uint64_t start)
+{
+#if CALL_PROFILE == 1
+    uint64_t ns = phase_clock() - start;
+    size_t name_len = strcspn(name, "(");
+
+    for(size_t i = 0; i < call_profile_count; i++)
+    {
+        struct call_profile *entry = &call_profile[i];
+        if(entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0)
+        {
+            entry->calls++;
+            entry->ns += ns;
+            return;
+        }
+    }
+
+    if(call_profile_count == CALL_PROFILE_SIZE) return;
+
+    struct call_profile *entry = &call_profile[call_profile_count++];
+    entry->name = name;
+    entry->name_len = name_len;
+    entry->calls = 1;
+    entry->ns = ns;
+#else
+    (void)name;
+    (void)start;
+#endif
+}
+
+/// @brief Appends "<path>\t<entry point> <calls> <ns>\t..." to the file named by HARNESS_CALL_LOG
+void profile_log(const char *path)
+{
+#if CALL_PROFILE == 1
+    const char *log_path = getenv("HARNESS_CALL_LOG");
+    if(log_path == NULL || log_path[0] == '\0') return;
+
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd == -1) return;
+
+    char line[4096 + CALL_PROFILE_SIZE * 96];
+    int len = snprintf(line, sizeof(line), "%s", path);
+    for(size_t i = 0; i < call_profile_count && len > 0 && (size_t)len < sizeof(line); i++)
+    {
+        const struct call_profile *entry = &call_profile[i];
+        len += snprintf(line + len, sizeof(line) - len, "\t%.*s %llu %llu", (int)entry->name_len, entry->name,
+                        (unsigned long long)entry->calls, (unsigned long long)entry->ns);
+    }
+
+    if(len > 0 && (size_t)len < sizeof(line) - 1)
+    {
+        line[len++] = '\n';
+        if(write(fd, line, len) < 0) log_error("error writing %s\n", log_path);
+    }
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+/////////////////////////////////////////////
+// RANDOM NUMBER GENERATOR:
+/////////////////////////////////////////////
+
+static inline uint64_t rng_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/// @brief splitmix64 step, used to expand the seed and to mix the input hash
+static inline uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/// @brief 64-bit hash of the whole input, 8 bytes at a time
+/// @param data - input bytes
+/// @param size - size of data
+/// @return - hash used as seed of the test case
+uint64_t input_hash(const uint8_t *data, size_t size)
+{
+    uint64_t h = size;
+    uint64_t word;
+    size_t i = 0;
+
+    for(; i + 8 <= size; i += 8)
+    {
+        memcpy(&word, data + i, 8);
+        h = rng_rotl(h ^ splitmix64(&word), 27) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    word = 0;
+    memcpy(&word, data + i, size - i);
+    h ^= splitmix64(&word);
+
+    return splitmix64(&h);
+}
+
+/// @brief Initializes the generator state from a 64-bit seed
+void rng_seed(struct fuzz_rng *rng, uint64_t seed)
+{
+    for(int i = 0; i < 4; i++)
+        rng->s[i] = splitmix64(&seed);
+
+    rng->input = NULL;
+    rng->input_size = 0;
+    rng->input_left = 0;
+}
+
+/// @brief Makes the next draws consume the last bytes of the input
+/// (at most INPUT_CONFIG_MAX_BYTES), then fall back to the generator
+void rng_attach_input(struct fuzz_rng *rng, const uint8_t *data, size_t size)
+{
+    size_t trailer = size < INPUT_CONFIG_MAX_BYTES ? size : INPUT_CONFIG_MAX_BYTES;
+
+    rng->input = data + size - trailer;
+    rng->input_size = trailer;
+    rng->input_left = trailer;
+}
+
+/// @brief Stops consuming the input
+/// @return - number of bytes consumed from the end of the input
+size_t rng_detach_input(struct fuzz_rng *rng)
+{
+    size_t consumed = rng->input_size - rng->input_left;
+
+    rng->input = NULL;
+    rng->input_size = 0;
+    rng->input_left = 0;
+
+    return consumed;
+}
+
+/// @brief Value in [0, n) consumed from the end of the attached input, using
+/// only as many bytes as n - 1 needs (same scheme as FuzzedDataProvider)
+static uint32_t rng_input_below(struct fuzz_rng *rng, uint32_t n)
+{
+    uint32_t range = n - 1;
+    uint64_t value = 0;
+
+    for(int shift = 0; shift < 32 && (range >> shift) != 0 && rng->input_left > 0; shift += 8)
+        value = (value << 8) | rng->input[--rng->input_left];
+
+    return (uint32_t)(value % n);
+}
+
+/// @brief xoshiro256** step
+/// @return - 64 random bits
+static inline uint64_t rng_next(struct fuzz_rng *rng)
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 45);
+
+    return result;
+}
+
+/// @brief Random value in [0, n), replaces rand() % n
+/// @param n - upper bound, must be greater than 0
+static inline uint32_t rng_below(struct fuzz_rng *rng, uint32_t n)
+{
+    if(rng->input_left > 0) return rng_input_below(rng, n);
+
+    return (uint32_t)(((rng_next(rng) >> 32) * n) >> 32);
+}
+
+/////////////////////////////////////////////
+// ARENA ALLOCATOR:
+/////////////////////////////////////////////
+
+/// @brief Bump allocator: the synthetic data of an execution is allocated from
+/// it and released all at once with arena_reset, the buffer is kept across executions
+struct fuzz_arena {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+};
+
+static HARNESS_LOCAL struct fuzz_arena write_arena = {NULL, 0, 0};
+
+/// @brief Allocates n bytes from the arena (16-byte aligned, followed by a redzone)
+/// @return - pointer to the bytes, NULL if the arena is full
+void *arena_alloc(struct fuzz_arena *arena, size_t n)
+{
+    if(arena->base == NULL)
+    {
+        arena->base = (uint8_t*)malloc(ARENA_SIZE);
+        if(arena->base == NULL) return NULL;
+        arena->size = ARENA_SIZE;
+        arena->used = 0;
+        ASAN_POISON_MEMORY_REGION(arena->base, arena->size);
+    }
+
+    // The redzone in front of the first allocation also catches underflows
+    size_t start = arena->used + ARENA_REDZONE;
+    size_t end = start + ((n + 15) & ~(size_t)15);
+    if(end + ARENA_REDZONE > arena->size) return NULL;
+
+    uint8_t *ptr = arena->base + start;
+    arena->used = end;
 
-PNGConfig get_PNGConfig(const char *fileName);
-void get_file_code(const char *path, char *output);
-void get_file_code_afl(const char *path, char *output);
-////////////////////////////////////////
-// MAIN:
-////////////////////////////////////////
+    ASAN_UNPOISON_MEMORY_REGION(ptr, n);
+#if HARNESS_MSAN == 1
+    // Bytes left by the previous execution must read as uninitialized again
+    __msan_allocated_memory(ptr, n);
+#endif
 
-int main(int argc, char **argv)
+    return ptr;
+}
+
+/// @brief Releases every allocation of the arena
+void arena_reset(struct fuzz_arena *arena)
 {
-    
- 
-    // Possibly we need to delete this part because the seed is set to the value at middle of the buffer
-    /*
-    int urandom = open("/dev/urandom", O_RDONLY);
-    
-    unsigned int seed;
-    if(read(urandom, &seed, sizeof(seed)) != sizeof(seed))
-    {
-        fprintf(stderr, "error reading from /dev/urandom\n");
-        srand(time(NULL));
-    }
-    else
+    if(arena->base == NULL) return;
+
+    ASAN_POISON_MEMORY_REGION(arena->base, arena->used);
+    arena->used = 0;
+}
+
+/////////////////////////////////////////////
+// LIBSPNG ALLOCATOR:
+/////////////////////////////////////////////
+
+#if SPNG_ALLOCATOR != 0
+
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+// size class of the blocks bypassing the pool
+#define POOL_DIRECT POOL_CLASSES
+
+/// @brief Header in front of every block given to libspng
+struct alloc_header {
+    size_t size; // bytes requested by libspng
+    size_t size_class; // index in pool_free_list, POOL_DIRECT if not pooled
+    struct alloc_header *next; // next free block of the same class
+};
+
+// keeps the blocks 16-byte aligned, as malloc does
+#define ALLOC_HEADER_SIZE ((sizeof(struct alloc_header) + 15) & ~(size_t)15)
+
+/// @brief Allocation counters of the current test case
+struct alloc_stats {
+    size_t allocs;
+    size_t frees;
+    size_t live_bytes;
+    size_t peak_bytes;
+};
+
+static HARNESS_LOCAL struct alloc_stats spng_alloc_stats;
+
+#if SPNG_ALLOCATOR == 2
+static HARNESS_LOCAL struct alloc_header *pool_free_list[POOL_CLASSES];
+#endif
+
+/// @brief Size class of a block of n bytes, POOL_DIRECT if too large for the pool
+static size_t pool_class(size_t n)
+{
+    size_t size_class = 0;
+    while(((size_t)1 << (size_class + POOL_MIN_SHIFT)) < n)
     {
-        srand(seed);
+        if(++size_class == POOL_CLASSES) return POOL_DIRECT;
     }
-    close(urandom);
-    */
-    char *buf = NULL;
-    long siz_buf;
-    int fd = -1;
+    return size_class;
+}
 
-    if(argc < 2)
+/// @brief Capacity of the blocks of a size class
+static size_t pool_class_size(size_t size_class)
+{
+    return (size_t)1 << (size_class + POOL_MIN_SHIFT);
+}
+
+static void *pool_malloc(size_t size)
+{
+    size_t size_class = pool_class(size);
+    size_t capacity = size_class == POOL_DIRECT ? size : pool_class_size(size_class);
+    struct alloc_header *header = NULL;
+
+#if SPNG_ALLOCATOR == 2
+    if(size_class != POOL_DIRECT && pool_free_list[size_class] != NULL)
     {
-        fprintf(stderr, "no input file\n");
-        goto error;
+        header = pool_free_list[size_class];
+        ASAN_UNPOISON_MEMORY_REGION(header, ALLOC_HEADER_SIZE);
+        pool_free_list[size_class] = header->next;
     }
+#endif
 
-    fd = open(argv[1], O_RDONLY);
-    if(fd == -1)
+    if(header == NULL)
     {
-        fprintf(stderr, "error opening input file %s\n", argv[1]);
-        goto error;
+        header = (struct alloc_header*)malloc(ALLOC_HEADER_SIZE + capacity);
+        if(header == NULL) return NULL;
     }
 
-    // get file size
-    siz_buf = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
+    header->size = size;
+    header->size_class = size_class;
+    header->next = NULL;
 
-    if(siz_buf < 1) {
-        fprintf(stderr, "file is empty\n");
-        goto error;
-    }
+    uint8_t *ptr = (uint8_t*)header + ALLOC_HEADER_SIZE;
+
+    // Only the requested bytes are addressable, the header and the
+    // rest of the size class are poisoned as a malloc redzone would be
+    ASAN_POISON_MEMORY_REGION(header, ALLOC_HEADER_SIZE + capacity);
+    ASAN_UNPOISON_MEMORY_REGION(ptr, size);
+#if HARNESS_MSAN == 1
+    // A recycled block must read as uninitialized, as a fresh one
+    __msan_allocated_memory(ptr, size);
+#endif
+
+    spng_alloc_stats.allocs++;
+    spng_alloc_stats.live_bytes += size;
+    if(spng_alloc_stats.live_bytes > spng_alloc_stats.peak_bytes)
+        spng_alloc_stats.peak_bytes = spng_alloc_stats.live_bytes;
+
+    return ptr;
+}
+
+static void pool_free(void *ptr)
+{
+    if(ptr == NULL) return;
+
+    struct alloc_header *header = (struct alloc_header*)((uint8_t*)ptr - ALLOC_HEADER_SIZE);
+    ASAN_UNPOISON_MEMORY_REGION(header, ALLOC_HEADER_SIZE);
 
-    // allocate buffer
-    buf = (char*)malloc(siz_buf);
-    if(buf == NULL)
+    spng_alloc_stats.frees++;
+    spng_alloc_stats.live_bytes -= header->size;
+
+#if SPNG_ALLOCATOR == 2
+    if(header->size_class != POOL_DIRECT)
     {
-        fprintf(stderr, "malloc() failed\n");
-        goto error;
+        header->next = pool_free_list[header->size_class];
+        pool_free_list[header->size_class] = header;
+
+        // A use after free in libspng hits poisoned memory until the block is reused
+        ASAN_POISON_MEMORY_REGION(header, ALLOC_HEADER_SIZE + pool_class_size(header->size_class));
+        return;
     }
+#endif
 
-    // read file
-    if(read(fd, buf, siz_buf) == -1)
+    free(header);
+}
+
+static void *pool_realloc(void *ptr, size_t size)
+{
+    if(ptr == NULL) return pool_malloc(size);
+
+    struct alloc_header *header = (struct alloc_header*)((uint8_t*)ptr - ALLOC_HEADER_SIZE);
+    ASAN_UNPOISON_MEMORY_REGION(header, ALLOC_HEADER_SIZE);
+    size_t old_size = header->size;
+    size_t size_class = header->size_class;
+
+    // Still fits in its size class: only the addressable bytes change
+    if(size_class != POOL_DIRECT && size <= pool_class_size(size_class))
     {
-        fprintf(stderr, "fread() failed\n");
-        goto error;
+        header->size = size;
+        ASAN_POISON_MEMORY_REGION(header, ALLOC_HEADER_SIZE + pool_class_size(size_class));
+        ASAN_UNPOISON_MEMORY_REGION(ptr, size);
+
+        spng_alloc_stats.live_bytes = spng_alloc_stats.live_bytes - old_size + size;
+        if(spng_alloc_stats.live_bytes > spng_alloc_stats.peak_bytes)
+            spng_alloc_stats.peak_bytes = spng_alloc_stats.live_bytes;
+
+        return ptr;
     }
+    ASAN_POISON_MEMORY_REGION(header, ALLOC_HEADER_SIZE);
 
-    unsigned int seed;
+    void *new_ptr = pool_malloc(size);
+    if(new_ptr == NULL) return NULL;
 
-    // Setting seed to random value in the middle of the buffer
-    seed = (unsigned int) buf[siz_buf/2];
-    srand(seed);
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    pool_free(ptr);
 
-    int success = 0;
-    char fileName[256];
+    return new_ptr;
+}
+
+static void *pool_calloc(size_t count, size_t size)
+{
+    if(size && count > SIZE_MAX / size) return NULL;
+
+    void *ptr = pool_malloc(count * size);
+    if(ptr != NULL) memset(ptr, 0, count * size);
+
+    return ptr;
+}
+
+static struct spng_alloc harness_alloc = {pool_malloc, pool_realloc, pool_calloc, pool_free};
+
+#define harness_ctx_new(flags) spng_ctx_new2(&harness_alloc, (flags))
+// buffers returned by spng_get_png_buffer() come from the context allocator
+#define harness_png_free(ptr) pool_free(ptr)
+#define alloc_stats_reset() memset(&spng_alloc_stats, 0, sizeof(spng_alloc_stats))
+#define alloc_stats_log()                                                               \
+    log_trace("libspng allocations: %zu, frees: %zu, peak bytes: %zu\n",               \
+              spng_alloc_stats.allocs, spng_alloc_stats.frees, spng_alloc_stats.peak_bytes)
 
-#if AFL_MODE == 1
-    get_file_code_afl(argv[1], fileName);
 #else
-    get_file_code(argv[1], fileName);
-#endif
-    printf("File name: %s\n", fileName);
 
-#if TEST_TYPE == 0 // Specific read
-    success = fuzz_spng_read((const uint8_t *)buf, siz_buf);
-#elif TEST_TYPE == 1 // Specific write
-    PNGConfig config = getPNGConfig(fileName);
-    success = fuzz_spng_write((const uint8_t *)buf, siz_buf, config);
-#else // Random read or write
-    if (rand() % 2 == 0)
-        success = fuzz_spng_read((const uint8_t *)buf, siz_buf);
-    else{
-        PNGConfig config = get_PNGConfig(fileName);
-        success = fuzz_spng_write((const uint8_t *)buf, siz_buf, config);
+#define harness_ctx_new(flags) spng_ctx_new(flags)
+#define harness_png_free(ptr) free(ptr)
+#define alloc_stats_reset() ((void)0)
+#define alloc_stats_log() ((void)0)
+
+#endif // SPNG_ALLOCATOR
+
+/////////////////////////////////////////////
+// DECODE OUTPUT BUFFER:
+/////////////////////////////////////////////
+
+#if REUSE_DECODE_BUFFER == 1
+
+/// @brief Output buffer of spng_decode_image, it only grows and is kept across test cases
+struct decode_buffer {
+    unsigned char *data;
+    size_t capacity;
+};
+
+static HARNESS_LOCAL struct decode_buffer decode_buf = {NULL, 0};
+
+/// @brief Gets an output buffer of size bytes, only them are addressable
+/// @return - the buffer, NULL if it can't grow
+unsigned char *decode_buffer_acquire(size_t size)
+{
+    if(decode_buf.data == NULL || size > decode_buf.capacity)
+    {
+        // Doubling keeps the number of regrowths low, the cap still holds
+        size_t capacity = decode_buf.capacity * 2;
+        if(capacity < size) capacity = size;
+        if(capacity > MAX_DECODE_SIZE) capacity = size;
+        if(capacity == 0) capacity = 1;
+
+        ASAN_UNPOISON_MEMORY_REGION(decode_buf.data, decode_buf.capacity);
+        free(decode_buf.data);
+
+        decode_buf.data = (unsigned char*)malloc(capacity);
+        decode_buf.capacity = decode_buf.data != NULL ? capacity : 0;
+        if(decode_buf.data == NULL) return NULL;
     }
+
+    // Writing past the image is reported as a heap overflow of a fresh malloc would be
+    ASAN_UNPOISON_MEMORY_REGION(decode_buf.data, size);
+    ASAN_POISON_MEMORY_REGION(decode_buf.data + size, decode_buf.capacity - size);
+#if HARNESS_MSAN == 1
+    // The previous image must read as uninitialized, as a fresh malloc would
+    __msan_allocated_memory(decode_buf.data, size);
 #endif
 
-    free(buf);
-    if (fd != -1) 
-        close(fd);
+    return decode_buf.data;
+}
 
-    return success;
+/// @brief Gives the output buffer back, any later access to it is a use after free under ASan
+void decode_buffer_release(unsigned char *img)
+{
+    (void)img;
+    ASAN_POISON_MEMORY_REGION(decode_buf.data, decode_buf.capacity);
+}
 
-error:
-    free(buf);
-    if (fd != -1) 
-        close(fd);
+#else
 
-    return 0;
-}
+#define decode_buffer_acquire(size) ((unsigned char*)malloc(size))
+#define decode_buffer_release(img) free(img)
 
-//////////////////////////
-// DEFINITIONS:
-//////////////////////////
+#endif // REUSE_DECODE_BUFFER
 
-// FUNCTIONS TAKEN FROM spng.c
+/////////////////////////////////////////////
+// INPUT-INDEPENDENT SETUP:
+/////////////////////////////////////////////
 
-/// @brief Struct to store buffer state
-struct buf_state
-{
-    const uint8_t *data;
-    size_t bytes_left;
+// Initialize enums from spng.h
+static const enum spng_format fmt_flags[] = {
+    SPNG_FMT_RGBA8, SPNG_FMT_RGBA16, SPNG_FMT_RGB8,
+    SPNG_FMT_GA8, SPNG_FMT_GA16, SPNG_FMT_G8,
+    SPNG_FMT_PNG, SPNG_FMT_RAW
 };
+#define TOTAL_TMP_FLAGS ((int)(sizeof(fmt_flags) / sizeof(enum spng_format)))
 
-/// @brief Read function for spng_set_png_stream
-/// @param ctx - spng context
-/// @param user - user data
-/// @param dest - destination buffer
-/// @param length - length of data to read
-/// @return - 0 on success, SPNG_IO_EOF on failure
-static int buffer_read_fn(spng_ctx *ctx, void *user, void *dest, size_t length)
+static const enum spng_decode_flags decode_flags[] = {
+    SPNG_DECODE_USE_TRNS, SPNG_DECODE_USE_GAMA, SPNG_DECODE_USE_SBIT,
+    SPNG_DECODE_TRNS, SPNG_DECODE_GAMMA, SPNG_DECODE_PROGRESSIVE
+};
+#define TOTAL_DECODE_FLAGS ((int)(sizeof(decode_flags) / sizeof(enum spng_decode_flags)))
+
+static const enum spng_option options_list[] = {
+    SPNG_KEEP_UNKNOWN_CHUNKS, // true, false
+    SPNG_IMG_COMPRESSION_LEVEL, // defaul -1, 0-9
+    SPNG_IMG_WINDOW_BITS, // default 15, 8-15
+    SPNG_IMG_MEM_LEVEL, // default 8, 1-9
+    SPNG_IMG_COMPRESSION_STRATEGY, // default 0, 0-4
+    SPNG_TEXT_COMPRESSION_LEVEL, // default -1, 0-9
+    SPNG_TEXT_WINDOW_BITS, // default 15, 8-15
+    SPNG_TEXT_MEM_LEVEL, // default 8, 1-9
+    SPNG_TEXT_COMPRESSION_STRATEGY, // default 0, 0-4
+    SPNG_FILTER_CHOICE, // default 0, 0-4
+    SPNG_CHUNK_COUNT_LIMIT, // default 0, 0-UINT32_MAX
+    SPNG_ENCODE_TO_BUFFER, // true, false
+};
+#define TOTAL_OPTIONS ((int)(sizeof(options_list) / sizeof(enum spng_option)))
+
+// 1x1 8-bit grayscale PNG used to warm up libspng and zlib
+static const uint8_t warm_up_png[] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a, 0x00, 0x00, 0x00, 0x0d,
+    0x49, 0x48, 0x44, 0x52, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+    0x08, 0x00, 0x00, 0x00, 0x00, 0x3a, 0x7e, 0x9b, 0x55, 0x00, 0x00, 0x00,
+    0x0a, 0x49, 0x44, 0x41, 0x54, 0x78, 0xda, 0x63, 0x68, 0x00, 0x00, 0x00,
+    0x82, 0x00, 0x81, 0xda, 0x45, 0x08, 0x3b, 0x00, 0x00, 0x00, 0x00, 0x49,
+    0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82
+};
+
+static const char *libspng_version = NULL;
+static char stdout_buf[BUFSIZ];
+
+/// @brief Decodes and re-encodes warm_up_png, so the lazily initialized
+/// zlib/CRC state and the libspng code pages are already resident
+static void harness_warm_up(void)
 {
-    struct buf_state *state = (struct buf_state*)user;
-    (void)ctx;
+    unsigned char pixels[4] = {0};
+    size_t out_size;
 
-    if(length > state->bytes_left) return SPNG_IO_EOF;
+    spng_ctx *ctx = harness_ctx_new(0);
+    if(ctx == NULL) return;
 
-    memcpy(dest, state->data, length);
+    if(!spng_set_png_buffer(ctx, warm_up_png, sizeof(warm_up_png)) &&
+       !spng_decoded_image_size(ctx, SPNG_FMT_G8, &out_size) && out_size <= sizeof(pixels))
+    {
+        spng_decode_image(ctx, pixels, out_size, SPNG_FMT_G8, 0);
+    }
+    spng_ctx_free(ctx);
 
-    state->bytes_left -= length;
-    state->data += length;
+    ctx = harness_ctx_new(SPNG_CTX_ENCODER);
+    if(ctx == NULL) return;
 
-    return 0;
+    struct spng_ihdr ihdr = {1, 1, 8, SPNG_COLOR_TYPE_GRAYSCALE, 0, 0, 0};
+    spng_set_option(ctx, SPNG_ENCODE_TO_BUFFER, 1);
+    spng_set_ihdr(ctx, &ihdr);
+    if(!spng_encode_image(ctx, pixels, 1, SPNG_FMT_PNG, SPNG_ENCODE_FINALIZE))
+    {
+        int error;
+        size_t png_size;
+        void *png = spng_get_png_buffer(ctx, &png_size, &error);
+        harness_png_free(png);
+    }
+    spng_ctx_free(ctx);
 }
 
-/// @brief Write function for spng_set_png_stream
-/// @param ctx - spng context
-/// @param user - user data
-/// @param data - data to write
-/// @param length - length of data to write
-/// @return - 0 on success, SPNG_IO_EOF on failure
-static int stream_write_fn(spng_ctx *ctx, void *user, void *data, size_t length)
+/// @brief Setup shared by every test case, done once per process
+/// (and before the AFL++ forkserver starts, so forked children inherit it)
+void harness_init(void)
 {
-    struct buf_state *state = (struct buf_state*)user;
-    (void)ctx;
+    // Allocate the stdout buffer now instead of on the first printf of every child
+    setvbuf(stdout, stdout_buf, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, sizeof(stdout_buf));
 
-    if(length > state->bytes_left) return SPNG_IO_EOF;
+    // libFuzzer has its own crash handling and death callback
+#if CRASH_RING == 1 && LIBFUZZER_MODE == 0
+    crash_ring_install();
+#endif
 
-    state->bytes_left -= length;
+#if WATCHDOG_MS > 0
+    watchdog_install();
+#endif
 
-    if(state->data)
+    libspng_version = spng_version_string();
+
+    harness_warm_up();
+}
+
+/// @brief Frees the buffers kept across the test cases of the calling thread
+/// (arena, pool and output buffer), to be called by a thread before it exits
+void harness_thread_cleanup(void)
+{
+    if(write_arena.base != NULL)
     {
-        memcpy(data, state->data, length);
-        state->data += length;
+        ASAN_UNPOISON_MEMORY_REGION(write_arena.base, write_arena.size);
+        free(write_arena.base);
+        write_arena.base = NULL;
+        write_arena.size = 0;
+        write_arena.used = 0;
     }
 
-    return 0;
+#if SPNG_ALLOCATOR == 2
+    for(size_t i = 0; i < POOL_CLASSES; i++)
+    {
+        while(pool_free_list[i] != NULL)
+        {
+            struct alloc_header *header = pool_free_list[i];
+            ASAN_UNPOISON_MEMORY_REGION(header, ALLOC_HEADER_SIZE + pool_class_size(i));
+            pool_free_list[i] = header->next;
+            free(header);
+        }
+    }
+#endif
+
+#if REUSE_DECODE_BUFFER == 1
+    ASAN_UNPOISON_MEMORY_REGION(decode_buf.data, decode_buf.capacity);
+    free(decode_buf.data);
+    decode_buf.data = NULL;
+    decode_buf.capacity = 0;
+#endif
 }
 
-// end spng.c
+/// @brief Runs one test case, shared by main() and the in-process entry points
+/// @param data - input bytes
+/// @param size - size of data, must be at least 1
+/// @param fileName - 8 char file code used to derive the write configuration
+/// @return - result of fuzz_spng_read or fuzz_spng_write
+int fuzz_one_input(const uint8_t *data, size_t size, const char *fileName)
+{
+    int success = 0;
+
+    ring_reset();
+    alloc_stats_reset();
+    watchdog_arm();
+
+    // Seeding from a hash of the whole input: the same input always
+    // gets the same configuration, and any change gives a new one
+    struct fuzz_rng rng;
+    rng_seed(&rng, input_hash(data, size));
+
+#if INPUT_CONFIG == 1
+    // The read/write choice and the read configuration come from the input
+    // trailer, fuzz_spng_read detaches it once its configuration is drawn
+    rng_attach_input(&rng, data, size);
+#endif
+
+    uint64_t phase_start = phase_clock();
+
+#if TEST_TYPE == 0 // Specific read
+    (void)fileName;
+    success = fuzz_spng_read(data, size, &rng);
+    phase_add(PHASE_DECODE, phase_start);
+#elif TEST_TYPE == 1 // Specific write
+    rng_detach_input(&rng);
+    PNGConfig config = get_PNGConfig(fileName, &rng);
+    success = fuzz_spng_write(data, size, config, &rng);
+    phase_add(PHASE_ENCODE, phase_start);
+#else // Random read or write
+    if (rng_below(&rng, 2) == 0){
+        success = fuzz_spng_read(data, size, &rng);
+        phase_add(PHASE_DECODE, phase_start);
+    }
+    else{
+        rng_detach_input(&rng);
+        PNGConfig config = get_PNGConfig(fileName, &rng);
+        success = fuzz_spng_write(data, size, config, &rng);
+        phase_add(PHASE_ENCODE, phase_start);
+    }
+#endif
+
+    watchdog_disarm();
+    alloc_stats_log();
+
+    return success;
+}
 
 /////////////////////////////////////////////
 // HELP FUNCTIONS:
@@ -297,52 +2319,53 @@ static int stream_write_fn(spng_ctx *ctx, void *user, void *data, size_t length)
 
 /// @brief Helper function to choose random options for spng_set_option
 /// @param options_list - list of options to choose from
-/// @param TOTAL_OPTIONS - total number of options in options_list
+/// @param total_options - total number of options in options_list
 /// @param num_options - number of options to choose
 /// @param chosen_options - array to store chosen options
 /// @param chosen_values - array to store chosen values
-void choose_random_options(enum spng_option options_list[], int TOTAL_OPTIONS, int num_options, int chosen_options[], int chosen_values[]){
+/// @param rng - random number generator of the test case
+void choose_random_options(const enum spng_option options_list[], int total_options, int num_options, int chosen_options[], int chosen_values[], struct fuzz_rng *rng){
     for(int i = 0; i < num_options; i++){
-        chosen_options[i] = options_list[rand() % TOTAL_OPTIONS];
+        chosen_options[i] = options_list[rng_below(rng, total_options)];
         int compression_levels[] = {0, 1, 2, 9};
         int filter_choices[] = {SPNG_DISABLE_FILTERING, SPNG_FILTER_CHOICE_NONE, SPNG_FILTER_CHOICE_SUB, SPNG_FILTER_CHOICE_UP, SPNG_FILTER_CHOICE_AVG, SPNG_FILTER_CHOICE_PAETH, SPNG_FILTER_CHOICE_ALL};
         switch (chosen_options[i])
         {
         case SPNG_KEEP_UNKNOWN_CHUNKS:
-            chosen_values[i] = rand() % 2;
+            chosen_values[i] = rng_below(rng, 2);
             break;
         case SPNG_IMG_COMPRESSION_LEVEL:
-            chosen_values[i] = compression_levels[rand() % 4];
+            chosen_values[i] = compression_levels[rng_below(rng, 4)];
             break;
         case SPNG_IMG_WINDOW_BITS:
-            chosen_values[i] = rand() % 8 + 8;
+            chosen_values[i] = rng_below(rng, 8) + 8;
             break;
         case SPNG_IMG_MEM_LEVEL:
-            chosen_values[i] = rand() % 9 + 1;
+            chosen_values[i] = rng_below(rng, 9) + 1;
             break;
         case SPNG_IMG_COMPRESSION_STRATEGY:
-            chosen_values[i] = rand() % 5;
+            chosen_values[i] = rng_below(rng, 5);
             break;
         case SPNG_TEXT_COMPRESSION_LEVEL:
-            chosen_values[i] = compression_levels[rand() % 4];
+            chosen_values[i] = compression_levels[rng_below(rng, 4)];
             break;
         case SPNG_TEXT_WINDOW_BITS:
-            chosen_values[i] = rand() % 8 + 8;
+            chosen_values[i] = rng_below(rng, 8) + 8;
             break;
         case SPNG_TEXT_MEM_LEVEL:
-            chosen_values[i] = rand() % 9 + 1;
+            chosen_values[i] = rng_below(rng, 9) + 1;
             break;
         case SPNG_TEXT_COMPRESSION_STRATEGY:
-            chosen_values[i] = rand() % 5;
+            chosen_values[i] = rng_below(rng, 5);
             break;
         case SPNG_FILTER_CHOICE:
-            chosen_values[i] = filter_choices[rand() % 7];
+            chosen_values[i] = filter_choices[rng_below(rng, 7)];
             break;
         case SPNG_CHUNK_COUNT_LIMIT:
-            chosen_values[i] = rand() % UINT32_MAX;
+            chosen_values[i] = rng_below(rng, INT32_MAX);
             break;
         case SPNG_ENCODE_TO_BUFFER:
-            chosen_values[i] = rand() % 2;
+            chosen_values[i] = rng_below(rng, 2);
             break;
         default:
             break;
@@ -354,19 +2377,84 @@ void choose_random_options(enum spng_option options_list[], int TOTAL_OPTIONS, i
 // FUZZ FUNCTIONS:
 /////////////////////////////////////////////
 
+/// @brief Configuration of one spng_read test, drawn at random by fuzz_spng_read
+/// or enumerated by sweep_spng_read
+struct read_config {
+    int source; // READ_SOURCE_*
+    int crc_critical; // action on CRC errors of critical chunks
+    int crc_ancillary; // action on CRC errors of ancillary chunks
+    int decode_mode; // DECODE_ONESHOT, DECODE_PROGRESSIVE or DECODE_ROWS
+    int fmt;
+    int flags;
+    int num_options;
+    int chosen_options[TOTAL_OPTIONS];
+    int chosen_values[TOTAL_OPTIONS];
+};
+
+// where libspng reads the PNG from
+#define READ_SOURCE_BUFFER 0 // spng_set_png_buffer
+#define READ_SOURCE_STREAM 1 // spng_set_png_stream
+#define READ_SOURCE_FILE 2 // spng_set_png_file
+
 /// @brief Fuzz function for spng_read
 /// @param data - data to read
 /// @param size - size of data
+/// @param rng - random number generator of the test case
 /// @return - 0 on success, 1 on failure
-int fuzz_spng_read(const uint8_t* data, size_t size)
+int fuzz_spng_read(const uint8_t* data, size_t size, struct fuzz_rng *rng)
 {
-    printf("Fuzzing spng_read...\n");
+    log_trace("Fuzzing spng_read...\n");
+    ring_mark("Fuzzing spng_read");
+
+    // Set up random configuration
+    struct read_config config;
+    int stream = rng_below(rng, 2);
+    int file_stream = rng_below(rng, 2);
+    int discard = rng_below(rng, 2);
+
+    config.source = !stream ? READ_SOURCE_BUFFER : file_stream ? READ_SOURCE_FILE : READ_SOURCE_STREAM;
+    config.crc_critical = SPNG_CRC_USE;
+    config.crc_ancillary = discard ? SPNG_CRC_DISCARD : SPNG_CRC_USE;
+    config.decode_mode = rng_below(rng, 3);
+#if DECODE_MODE != 3
+    config.decode_mode = DECODE_MODE;
+#endif
+    config.fmt = fmt_flags[rng_below(rng, TOTAL_TMP_FLAGS)];
+    config.flags = decode_flags[rng_below(rng, TOTAL_DECODE_FLAGS)];
+
+    config.num_options = rng_below(rng, TOTAL_OPTIONS);
+    choose_random_options(options_list, TOTAL_OPTIONS, config.num_options, config.chosen_options, config.chosen_values, rng);
+
+    // With INPUT_CONFIG the configuration was consumed from the end of
+    // the input, only the bytes before it are given to libspng
+    size -= rng_detach_input(rng);
+
+    int error;
+    return fuzz_spng_read_config(data, size, &config, &error);
+}
 
+/// @brief Reads data with one configuration, in a fresh context
+/// @param data - data to read
+/// @param size - size of data
+/// @param config - configuration of the test
+/// @param error - set to 0 if the image was decoded, to the error of the failing
+/// libspng call otherwise (-1 if the harness rejected the image)
+/// @return - 0 on success, 1 on failure
+int fuzz_spng_read_config(const uint8_t* data, size_t size, const struct read_config *config, int *error)
+{
     // Initialization
-    int fn_ret;
+    int fn_ret = 0;
+    int ret = 0;
+    int failed = 0;
     unsigned char *img = NULL;
+    unsigned char *rows[ROW_BUFFER_ROWS] = {NULL};
+    size_t row_size = 0;
     FILE *file = NULL;
 
+    int decode_mode = config->decode_mode;
+    int fmt = config->fmt;
+    int flags = config->flags;
+
     struct spng_ihdr ihdr;
     struct spng_plte plte;
     struct spng_trns trns;
@@ -398,86 +2486,43 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
     state.data = data;
     state.bytes_left = size;
 
-    // Initialize enums from spng.h
-    enum spng_format fmt_flags[] = {
-        SPNG_FMT_RGBA8, SPNG_FMT_RGBA16, SPNG_FMT_RGB8,
-        SPNG_FMT_GA8, SPNG_FMT_GA16, SPNG_FMT_G8,
-        SPNG_FMT_PNG, SPNG_FMT_RAW
-    };
-    int TOTAL_TMP_FLAGS = sizeof(fmt_flags) / sizeof(enum spng_format);
-
-    enum spng_decode_flags decode_flags[] = {
-        SPNG_DECODE_USE_TRNS, SPNG_DECODE_USE_GAMA, SPNG_DECODE_USE_SBIT,
-        SPNG_DECODE_TRNS, SPNG_DECODE_GAMMA, SPNG_DECODE_PROGRESSIVE
-    };
-    int TOTAL_DECODE_FLAGS = sizeof(decode_flags) / sizeof(enum spng_decode_flags);
-
-    enum spng_option options_list[] = {
-        SPNG_KEEP_UNKNOWN_CHUNKS, // true, false
-        SPNG_IMG_COMPRESSION_LEVEL, // defaul -1, 0-9
-        SPNG_IMG_WINDOW_BITS, // default 15, 8-15
-        SPNG_IMG_MEM_LEVEL, // default 8, 1-9
-        SPNG_IMG_COMPRESSION_STRATEGY, // default 0, 0-4
-        SPNG_TEXT_COMPRESSION_LEVEL, // default -1, 0-9
-        SPNG_TEXT_WINDOW_BITS, // default 15, 8-15
-        SPNG_TEXT_MEM_LEVEL, // default 8, 1-9
-        SPNG_TEXT_COMPRESSION_STRATEGY, // default 0, 0-4
-        SPNG_FILTER_CHOICE, // default 0, 0-4
-        SPNG_CHUNK_COUNT_LIMIT, // default 0, 0-UINT32_MAX
-        SPNG_ENCODE_TO_BUFFER, // true, false
-    };
-    int TOTAL_OPTIONS = sizeof(options_list) / sizeof(enum spng_option);
-
-    // Set up random configuration
-    int stream = rand() % 2;
-    int file_stream = rand() % 2;
-    int discard = rand() % 2;
-    int progressive = rand() % 2;
-    int fmt = fmt_flags[rand() % TOTAL_TMP_FLAGS];
-    fmt = SPNG_FMT_RGBA8;
-    int flags = decode_flags[rand() % TOTAL_DECODE_FLAGS];
-    
-    int num_options = rand() % TOTAL_OPTIONS;
-    int chosen_options[num_options+1];
-    int chosen_values[num_options+1];
-    choose_random_options(options_list, TOTAL_OPTIONS, num_options, chosen_options, chosen_values);
-
     // Print configuration
-    printf("Configuration:\n");
-    printf(" - stream: %d\n", stream);
-    printf(" - file_stream: %d\n", file_stream);
-    printf(" - discard: %d\n", discard);
-    printf(" - progressive: %d\n", progressive);
-    printf(" - fmt: %d\n", fmt);
-    printf(" - flags: %d\n", flags);
-    printf(" - num_options: %d\n", num_options);
-
-    for(int i = 0; i < num_options; i++){
-        printf(" - Option %d, Value %d\n", chosen_options[i], chosen_values[i]);
+    log_trace("Configuration:\n");
+    log_config("source", config->source);
+    log_config("crc_critical", config->crc_critical);
+    log_config("crc_ancillary", config->crc_ancillary);
+    log_config("decode_mode", decode_mode);
+    log_config("fmt", fmt);
+    log_config("flags", flags);
+    log_config("num_options", config->num_options);
+
+    for(int i = 0; i < config->num_options; i++){
+        log_trace(" - Option %d, Value %d\n", config->chosen_options[i], config->chosen_values[i]);
+        ring_config("option", config->chosen_options[i]);
+        ring_config("value", config->chosen_values[i]);
     }
     
     // end Initialization
 
     // print version
-    printf("libspng version: %s\n", spng_version_string());
+    log_trace("libspng version: %s\n", libspng_version);
 
     // Test spng_ctx_new
-    spng_ctx *ctx = spng_ctx_new(SPNG_CTX_IGNORE_ADLER32);
-    if(ctx == NULL) return 0;
+    uint64_t ctx_start = profile_begin();
+    spng_ctx *ctx = harness_ctx_new(SPNG_CTX_IGNORE_ADLER32);
+    profile_end("spng_ctx_new", ctx_start);
+    if(ctx == NULL) goto err;
 
-    if(stream)
-    {
-        if(file_stream) {
-            // Simulate a file stream from data
-            file = fmemopen((void*)data, size, "rb");
+    if(config->source == READ_SOURCE_FILE) {
+        // Simulate a file stream from data
+        file = fmemopen((void*)data, size, "rb");
 
-            if(file == NULL) goto err;
-            
-            test(spng_set_png_file(ctx, file));
-        }
-        else {
-            test(spng_set_png_stream(ctx, buffer_read_fn, &state));
-        }
+        if(file == NULL) goto err;
+
+        test(spng_set_png_file(ctx, file));
+    }
+    else if(config->source == READ_SOURCE_STREAM) {
+        test(spng_set_png_stream(ctx, buffer_read_fn, &state));
     }
     else{
         test(spng_set_png_buffer(ctx, (void*)data, size));
@@ -487,7 +2532,7 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
 
     uint32_t width, height;
     test(spng_get_image_limits(ctx, &width, &height));
-    test(spng_set_image_limits(ctx, 200000, 200000));
+    test(spng_set_image_limits(ctx, IMAGE_LIMIT, IMAGE_LIMIT));
 
     size_t limits;
     test(spng_get_chunk_limits(ctx, &limits, &limits));
@@ -495,11 +2540,11 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
     limits = 4 * 1000 * 1000;
     test(spng_set_chunk_limits(ctx, limits, limits * 2));
 
-    test(spng_set_crc_action(ctx, SPNG_CRC_USE, discard ? SPNG_CRC_DISCARD : SPNG_CRC_USE))
+    test(spng_set_crc_action(ctx, config->crc_critical, config->crc_ancillary));
 
     // Test set_option with different configurations
-    for(int i = 0; i < num_options; i++){
-        test(spng_set_option(ctx, chosen_options[i], chosen_values[i]));
+    for(int i = 0; i < config->num_options; i++){
+        test(spng_set_option(ctx, config->chosen_options[i], config->chosen_values[i]));
     }
 
     test(spng_set_option(ctx, SPNG_KEEP_UNKNOWN_CHUNKS, 1));
@@ -513,10 +2558,29 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
     size_t out_size = 0;
     test(spng_decoded_image_size(ctx, fmt, &out_size));
     if(fn_ret) goto err;
-    if(out_size > 80000000) goto err;
 
-    img = (unsigned char*)malloc(out_size);
-    if(img == NULL) goto err;
+    if(decode_mode == DECODE_ROWS)
+    {
+        // Only ROW_BUFFER_ROWS rows are allocated, whatever the image height
+        test(spng_get_ihdr(ctx, &ihdr));
+        if(fn_ret) goto err;
+
+        row_size = out_size / ihdr.height;
+        if(row_size > MAX_DECODE_SIZE / ROW_BUFFER_ROWS) goto err;
+
+        // One allocation per row, so that under ASan a row overflow hits a redzone
+        for(int i = 0; i < ROW_BUFFER_ROWS; i++){
+            rows[i] = (unsigned char*)malloc(row_size);
+            if(rows[i] == NULL) goto err;
+        }
+    }
+    else
+    {
+        if(out_size > MAX_DECODE_SIZE) goto err;
+
+        img = decode_buffer_acquire(out_size);
+        if(img == NULL) goto err;
+    }
 
     //// Test get methods
     test(spng_get_ihdr(ctx, &ihdr));
@@ -532,7 +2596,9 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
     test(spng_get_srgb(ctx, &srgb_rendering_intent));
 
     // Test spng_get_text for 4 and for arbitrary number
-    printf("Testing spng_get_text...");
+    log_trace("Testing spng_get_text...");
+    unsigned int text_idx = ring_call_begin("spng_get_text(ctx, text, &n_text)");
+    uint64_t text_start = profile_begin();
     if(!spng_get_text(ctx, text, &n_text))
     {/* Up to 4 entries were read, get the actual count */
         spng_get_text(ctx, NULL, &n_text);
@@ -545,23 +2611,30 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
                 text[i].translated_keyword == NULL ||
                 memchr(text[i].keyword, 0, 80) == NULL)
             {
-                spng_ctx_free(ctx);
-                free(img);
-                return 1;
+                // Marked done with -1 (rejected by the harness), the crash
+                // context must not show the call in progress
+                profile_end("spng_get_text(ctx, text, &n_text)", text_start);
+                ring_call_end(text_idx, -1);
+                ret = 1;
+                goto cleanup;
             }
 
             /* This shouldn't cause issues either */
             text[i].length = strlen(text[i].text);
         }
     }
-    printf("OK\n");
+    profile_end("spng_get_text(ctx, text, &n_text)", text_start);
+    ring_call_end(text_idx, 0);
+    log_trace("OK\n");
 
     test(spng_get_bkgd(ctx, &bkgd));
     test(spng_get_hist(ctx, &hist));
     test(spng_get_phys(ctx, &phys));
 
     // Test spng_get_splt for 4 and for arbitrary number
-    printf("Testing spng_get_splt...");
+    log_trace("Testing spng_get_splt...");
+    unsigned int splt_idx = ring_call_begin("spng_get_splt(ctx, splt, &n_splt)");
+    uint64_t splt_start = profile_begin();
     if(!spng_get_splt(ctx, splt, &n_splt))
     {/* Up to 4 entries were read, get the actual count */
         spng_get_splt(ctx, NULL, &n_splt);
@@ -571,15 +2644,20 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
                 splt[i].entries == NULL ||
                 memchr(splt[i].name, 0, 80) == NULL)
             {
-                spng_ctx_free(ctx);
-                free(img);
-                return 1;
+                profile_end("spng_get_splt(ctx, splt, &n_splt)", splt_start);
+                ring_call_end(splt_idx, -1);
+                ret = 1;
+                goto cleanup;
             }
         }
     }
-    printf("OK\n");
+    profile_end("spng_get_splt(ctx, splt, &n_splt)", splt_start);
+    ring_call_end(splt_idx, 0);
+    log_trace("OK\n");
 
     // Test spng_get_unknown_chunks for 4 and for arbitrary number
+    unsigned int chunks_idx = ring_call_begin("spng_get_unknown_chunks(ctx, chunks, &n_chunks)");
+    uint64_t chunks_start = profile_begin();
     if(!spng_get_unknown_chunks(ctx, chunks, &n_chunks))
     {
         spng_get_unknown_chunks(ctx, NULL, &n_chunks);
@@ -588,17 +2666,21 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
             if( (chunks[i].length && !chunks[i].data) ||
                 (!chunks[i].length && chunks[i].data) )
             {
-                spng_ctx_free(ctx);
-                free(img);
-                return 1;
+                profile_end("spng_get_unknown_chunks(ctx, chunks, &n_chunks)", chunks_start);
+                ring_call_end(chunks_idx, -1);
+                ret = 1;
+                goto cleanup;
             }
         }
     }
 
+    profile_end("spng_get_unknown_chunks(ctx, chunks, &n_chunks)", chunks_start);
+    ring_call_end(chunks_idx, 0);
+
     test(spng_get_offs(ctx, &offs));
     test(spng_get_exif(ctx, &exif));
 
-    if(progressive)
+    if(decode_mode == DECODE_PROGRESSIVE)
     {
         // test scanline
         test(spng_decode_scanline(ctx, img, out_size));
@@ -613,11 +2695,40 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
         // test row
         size_t ioffset, out_width = out_size / ihdr.height;
         struct spng_row_info ri;
+        unsigned int rows_idx = ring_call_begin("spng_decode_row loop");
+        uint64_t rows_start = profile_begin();
         do
         {
             if(spng_get_row_info(ctx, &ri)) break;
             ioffset = ri.row_num * out_width;
         }while(!spng_decode_row(ctx, img + ioffset, out_size));
+        profile_end("spng_decode_row loop", rows_start);
+        ring_call_end(rows_idx, 0);
+    }
+    else if(decode_mode == DECODE_ROWS)
+    {
+        // test scanline
+        test(spng_decode_scanline(ctx, rows[0], row_size));
+
+        // test decode_chunks
+        test(spng_decode_chunks(ctx));
+
+        // test decode_image
+        test(spng_decode_image(ctx, NULL, 0, fmt, flags | SPNG_DECODE_PROGRESSIVE));
+        if(fn_ret) goto err;
+
+        // test row, every row overwrites the oldest one of the ring buffer
+        struct spng_row_info ri;
+        unsigned int rows_idx = ring_call_begin("spng_decode_row ring buffer loop");
+        uint64_t rows_start = profile_begin();
+        unsigned char *row;
+        do
+        {
+            if(spng_get_row_info(ctx, &ri)) break;
+            row = rows[ri.row_num % ROW_BUFFER_ROWS];
+        }while(!spng_decode_row(ctx, row, row_size));
+        profile_end("spng_decode_row ring buffer loop", rows_start);
+        ring_call_end(rows_idx, 0);
     }
     else{
         test(spng_decode_image(ctx, img, out_size, fmt, flags));
@@ -626,34 +2737,96 @@ int fuzz_spng_read(const uint8_t* data, size_t size)
 
     test(spng_get_time(ctx, &time));
 
-    // Test spng_ctx_free
-    if(ctx != NULL){
-        printf("Testing spng_ctx_free...");
-        spng_ctx_free(ctx);
-        printf("OK\n");
-    } 
-    // end spng_ctx_free
-
-    printf("Finished\n");
-    if(img != NULL) free(img);
-    if(file != NULL) fclose(file);
-
-    return 0;
+    goto cleanup;
 
 err:
+    failed = 1;
+
+cleanup:
     // Test spng_ctx_free
     if(ctx != NULL){
-        printf("Testing spng_ctx_free...");
-        spng_ctx_free(ctx);
-        printf("OK\n");
+        test_void(spng_ctx_free(ctx));
     } 
     // end spng_ctx_free
 
-    printf("Finished with error\n");
-    if(img != NULL) free(img);
+    if(failed) log_trace("Finished with error\n");
+    else log_trace("Finished\n");
+
+    *error = failed ? (fn_ret ? fn_ret : -1) : 0;
+
+    if(img != NULL) decode_buffer_release(img);
+    for(int i = 0; i < ROW_BUFFER_ROWS; i++){
+        free(rows[i]);
+    }
     if(file != NULL) fclose(file);
 
-    return 0;
+    return ret;
+}
+
+/// @brief Sweep mode: reads one input with every format, subset of decode flags,
+/// CRC action and source, each in a fresh context, and prints one line per configuration
+/// @param data - data to read
+/// @param size - size of data
+/// @return - 1 if any configuration failed, 0 otherwise
+int sweep_spng_read(const uint8_t *data, size_t size)
+{
+    static const int crc_actions[][2] = {
+        {SPNG_CRC_ERROR, SPNG_CRC_ERROR}, {SPNG_CRC_ERROR, SPNG_CRC_DISCARD}, {SPNG_CRC_ERROR, SPNG_CRC_USE},
+        {SPNG_CRC_USE, SPNG_CRC_ERROR}, {SPNG_CRC_USE, SPNG_CRC_DISCARD}, {SPNG_CRC_USE, SPNG_CRC_USE}
+    };
+    static const char *source_names[] = {"buffer", "stream", "file"};
+    int total_crc_actions = (int)(sizeof(crc_actions) / sizeof(crc_actions[0]));
+
+    struct read_config config = {0};
+    int ret = 0, total = 0, decoded = 0;
+
+#if LOG_LEVEL >= LOG_ERRORS
+    log_muted = 1;
+#endif
+
+    for(int f = 0; f < TOTAL_TMP_FLAGS; f++){
+        for(int subset = 0; subset < (1 << TOTAL_DECODE_FLAGS); subset++){
+            for(int c = 0; c < total_crc_actions; c++){
+                for(int source = READ_SOURCE_BUFFER; source <= READ_SOURCE_FILE; source++){
+                    config.source = source;
+                    config.crc_critical = crc_actions[c][0];
+                    config.crc_ancillary = crc_actions[c][1];
+                    config.fmt = fmt_flags[f];
+                    config.flags = 0;
+                    for(int i = 0; i < TOTAL_DECODE_FLAGS; i++){
+                        if(subset & (1 << i)) config.flags |= decode_flags[i];
+                    }
+                    // The progressive flag selects the row by row decode
+                    config.decode_mode = (config.flags & SPNG_DECODE_PROGRESSIVE) ? DECODE_PROGRESSIVE : DECODE_ONESHOT;
+
+                    // Every configuration is a test case of its own for the crash context
+                    ring_reset();
+                    ring_mark("Sweeping spng_read");
+                    alloc_stats_reset();
+
+                    int error;
+                    ret |= fuzz_spng_read_config(data, size, &config, &error);
+
+                    printf("%5d fmt %3d flags 0x%03x crc %d/%d %-6s: ", total, config.fmt, config.flags,
+                           config.crc_critical, config.crc_ancillary, source_names[source]);
+                    if(error == 0) printf("OK\n");
+                    else if(error < 0) printf("rejected\n");
+                    else printf("%d %s\n", error, spng_strerror(error));
+
+                    total++;
+                    if(error == 0) decoded++;
+                }
+            }
+        }
+    }
+
+#if LOG_LEVEL >= LOG_ERRORS
+    log_muted = 0;
+#endif
+
+    printf("Sweep: %d configurations, %d decoded, %d failed\n", total, decoded, total - decoded);
+
+    return ret;
 }
 
 //////////////////////////////////////////////
@@ -679,7 +2852,7 @@ enum background getBackground(char background) {
 }
 
 // Function to derive a PNGConfig from the file name
-PNGConfig get_PNGConfig(const char *fileName) {
+PNGConfig get_PNGConfig(const char *fileName, struct fuzz_rng *rng) {
     PNGConfig config;
 
     // Default configuration
@@ -806,9 +2979,9 @@ PNGConfig get_PNGConfig(const char *fileName) {
                 config.ppu_y = 8;
                 break;
             case 'u':
-                config.ppu_x = rand() % 1000;
-                config.ppu_y = rand() % 1000;
-                config.unit_specifier = rand() % 2;
+                config.ppu_x = rng_below(rng, 1000);
+                config.ppu_y = rng_below(rng, 1000);
+                config.unit_specifier = rng_below(rng, 2);
                 break;
             default:
                 break;
@@ -949,7 +3122,7 @@ enum spng_decode_flags get_decode_flags_from_config(const PNGConfig *config) {
 
 void get_file_code_afl(const char *path, char *output) {
     
-    printf("Reading file code from AFL path\n");
+    log_trace("Reading file code from AFL path\n");
     const char *lastSlash = strrchr(path, '/'); // For UNIX-like paths
     if (!lastSlash) {
         lastSlash = strrchr(path, '\\'); // For Windows paths
@@ -986,52 +3159,157 @@ void get_file_code(const char *path, char *output) {
     output[length] = '\0'; // Null-terminate the string
 }
 
-char* get_random_string(size_t length) {
+char* get_random_string(struct fuzz_rng *rng, struct fuzz_arena *arena, size_t length) {
     if (length == 0) return NULL;
 
-    char *str = (char *)malloc(length + 1);
+    char *str = (char *)arena_alloc(arena, length + 1);
     if (!str) return NULL;
 
     for (size_t i = 0; i < length; i++) {
-        str[i] = rand() % 256;
+        str[i] = rng_below(rng, 256);
     }
     str[length] = '\0';
     return str;
 }
 
-int random_choice(){
-    return rand() % 2;
+int random_choice(struct fuzz_rng *rng){
+    return rng_below(rng, 2);
 }
 
-int select_random_with_probability(double success_rate){
-    return rand() % 100 < (success_rate * 100);
+int select_random_with_probability(struct fuzz_rng *rng, double success_rate){
+    return rng_below(rng, 100) < (success_rate * 100);
 }
 
-int choose_to_initialize(){
+int choose_to_initialize(struct fuzz_rng *rng){
     // 10% probability of not initializing
-    return select_random_with_probability(INITIALIZATION_PROB);
+    return select_random_with_probability(rng, INITIALIZATION_PROB);
+}
+
+/// @brief Bits per pixel of the image described by an IHDR
+/// @return - bits per pixel, 0 if the color type is invalid
+size_t ihdr_pixel_bits(const struct spng_ihdr *ihdr){
+    switch(ihdr->color_type)
+    {
+        case SPNG_COLOR_TYPE_GRAYSCALE:
+            return ihdr->bit_depth;
+        case SPNG_COLOR_TYPE_INDEXED:
+            return ihdr->bit_depth;
+        case SPNG_COLOR_TYPE_TRUECOLOR:
+            return ihdr->bit_depth * 3;
+        case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
+            return ihdr->bit_depth * 2;
+        case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA:
+            return ihdr->bit_depth * 4;
+        default: return 0;
+    }
+}
+
+/// @brief Size of the image described by an IHDR, as given to spng_encode_image
+/// @return - size in bytes, 0 if the color type is invalid
+size_t ihdr_image_size(const struct spng_ihdr *ihdr){
+    size_t img_size = ihdr->width * ihdr_pixel_bits(ihdr) + 7;
+    img_size /= 8;
+    img_size *= ihdr->height;
+
+    return img_size;
+}
+
+/// @brief Random width or height from 1 to max, log-uniform so that
+/// small and large images are equally likely
+uint32_t random_dimension(struct fuzz_rng *rng, size_t max){
+    if(max > IMAGE_LIMIT) max = IMAGE_LIMIT;
+    if(max < 1) return 1;
+
+    uint32_t bits = 0;
+    while(((size_t)2 << bits) <= max) bits++;
+
+    size_t range = (size_t)1 << rng_below(rng, bits + 1);
+    if(range > max) range = max;
+
+    return 1 + rng_below(rng, range);
+}
+
+/// @brief Synthesizes a valid IHDR whose image fits in size bytes,
+/// so that the encoder gets to run on the input bytes
+/// @param ihdr - IHDR to fill
+/// @param size - bytes available for the image, at least 1
+/// @param rng - random number generator of the test case
+void synthesize_ihdr(struct spng_ihdr *ihdr, size_t size, struct fuzz_rng *rng){
+    static const uint8_t color_types[] = {SPNG_COLOR_TYPE_GRAYSCALE, SPNG_COLOR_TYPE_TRUECOLOR,
+        SPNG_COLOR_TYPE_INDEXED, SPNG_COLOR_TYPE_GRAYSCALE_ALPHA, SPNG_COLOR_TYPE_TRUECOLOR_ALPHA};
+    static const uint8_t gray_depths[] = {1, 2, 4, 8, 16};
+
+    ihdr->color_type = color_types[rng_below(rng, 5)];
+    switch(ihdr->color_type)
+    {
+        case SPNG_COLOR_TYPE_GRAYSCALE:
+            ihdr->bit_depth = gray_depths[rng_below(rng, 5)];
+            break;
+        case SPNG_COLOR_TYPE_INDEXED:
+            ihdr->bit_depth = gray_depths[rng_below(rng, 4)];
+            break;
+        default:
+            ihdr->bit_depth = rng_below(rng, 2) ? 16 : 8;
+            break;
+    }
+    ihdr->compression_method = 0;
+    ihdr->filter_method = 0;
+    ihdr->interlace_method = rng_below(rng, 2);
+
+    // A single pixel must fit, the smallest inputs get 8-bit grayscale
+    size_t pixel_bits = ihdr_pixel_bits(ihdr);
+    if(pixel_bits > size * 8){
+        ihdr->color_type = SPNG_COLOR_TYPE_GRAYSCALE;
+        ihdr->bit_depth = 8;
+        pixel_bits = 8;
+    }
+
+    // Width first, then as many rows as the remaining bytes allow
+    ihdr->width = random_dimension(rng, size * 8 / pixel_bits);
+
+    size_t row_size = (ihdr->width * pixel_bits + 7) / 8;
+    ihdr->height = random_dimension(rng, size / row_size);
 }
 
 /// @brief Fuzz function for spng_write
 /// @param data - data to write
 /// @param size - size of data
+/// @param config - configuration derived from the file name
+/// @param rng - random number generator of the test case
 /// @return - 0 on success, 1 on failure
-int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config)
+int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config, struct fuzz_rng *rng)
 {
-    printf("Fuzzing spng_write...\n");
+    log_trace("Fuzzing spng_write...\n");
+    ring_mark("Fuzzing spng_write");
 
     // Initialization
     int fn_ret;
+    int ret = 0;
+    int failed = 0;
+
+    // Every string and array of the synthetic metadata comes from here
+    struct fuzz_arena *arena = &write_arena;
     unsigned char *img = NULL;
     size_t img_size;
-    size_t pixel_bits = 0;
 
     void *png = NULL;
     size_t png_size = 0;
 
+    // Format of the file name configuration, kept for the random IHDRs
+    int fmt = get_fmt_from_config(&config);
+
     struct spng_ihdr ihdr;
-    if (choose_to_initialize()){
-        if (select_random_with_probability(0.9)){
+    if (choose_to_initialize(rng)){
+        if (select_random_with_probability(rng, IHDR_INVALID_PROB)){
+            ihdr.width = rng_below(rng, UINT32_MAX);
+            ihdr.height = rng_below(rng, UINT32_MAX);
+            ihdr.bit_depth = rng_below(rng, UINT8_MAX);
+            ihdr.color_type = rng_below(rng, 7);
+            ihdr.compression_method = rng_below(rng, 10);
+            ihdr.filter_method = rng_below(rng, 10);
+            ihdr.interlace_method = rng_below(rng, 2);
+        }
+        else {
             ihdr.width = config.size;
             ihdr.height = config.size;
             ihdr.bit_depth = config.bitDepth;
@@ -1039,71 +3317,143 @@ int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config)
             ihdr.compression_method = config.compression;
             ihdr.filter_method = config.filtering;
             ihdr.interlace_method = config.interlace;
+
+            // The image of the file name configuration is used half of the time,
+            // if it fits in the input, otherwise the layout is made to fit
+            if (random_choice(rng) || ihdr_image_size(&ihdr) > size){
+                synthesize_ihdr(&ihdr, size, rng);
+            }
+
+            // The input bytes are the image in the layout of the IHDR, and
+            // spng_encode_image only takes SPNG_FMT_PNG or SPNG_FMT_RAW
+            fmt = SPNG_FMT_PNG;
         }
-        else {
-            ihdr.width = rand() % UINT32_MAX;
-            ihdr.height = rand() % UINT32_MAX;
-            ihdr.bit_depth = rand() % UINT8_MAX;
-            ihdr.color_type = rand() % 7;
-            ihdr.compression_method = rand() % 10;
-            ihdr.filter_method = rand() % 10;
-            ihdr.interlace_method = rand() % 2;
-        }
     }
 
+    struct buf_state state;
+    state.data = NULL;
+    state.bytes_left = rng_next(rng) % SIZE_MAX;
+
+    // Set up random configuration
+    int stream = rng_below(rng, 2);
+    int get_buffer = rng_below(rng, 2);
+    int progressive = rng_below(rng, 2);
+
+    int num_options = rng_below(rng, TOTAL_OPTIONS);
+    int chosen_options[num_options+1];
+    int chosen_values[num_options+1];
+    choose_random_options(options_list, TOTAL_OPTIONS, num_options, chosen_options, chosen_values, rng);
+
+    // Print configuration
+    log_trace("Configuration:\n");
+    log_config("stream", stream);
+    log_config("get_buffer", get_buffer);
+    log_config("progressive", progressive);
+    log_config("fmt", fmt);
+    log_config("num_options", num_options);
+
+    for(int i = 0; i < num_options; i++){
+        log_trace(" - Option %d, Value %d\n", chosen_options[i], chosen_values[i]);
+        ring_config("option", chosen_options[i]);
+        ring_config("value", chosen_values[i]);
+    }
+    
+    // end Initialization
+
+    // print version
+    log_trace("libspng version: %s\n", libspng_version);
+
+    // Test spng_ctx_new
+    uint64_t ctx_start = profile_begin();
+    spng_ctx *ctx = harness_ctx_new(SPNG_CTX_ENCODER);
+    profile_end("spng_ctx_new", ctx_start);
+    if(ctx == NULL) goto err;
+
+    test(spng_set_image_limits(ctx, IMAGE_LIMIT, IMAGE_LIMIT));
+
+    int limits = 4 * 1000 * 1000;
+    test(spng_set_chunk_limits(ctx, limits, limits * 2));
+    
+    spng_set_option(ctx, SPNG_IMG_COMPRESSION_LEVEL, 1);
+
+    if(stream){
+        test(spng_set_png_stream(ctx, stream_write_fn, &state));
+    }
+    else{
+        test(spng_set_option(ctx, SPNG_ENCODE_TO_BUFFER, 1));
+    } 
+
+    if(fn_ret) goto err;
+
+    for(int i = 0; i < num_options; i++){
+        test(spng_set_option(ctx, chosen_options[i], chosen_values[i]));
+    }
+
+    test(spng_set_ihdr(ctx, &ihdr));
+    if(fn_ret) goto err;
+
+    // Test colorspace
+    if(ihdr_pixel_bits(&ihdr) == 0) goto err;
+    img_size = ihdr_image_size(&ihdr);
+
+    // Metadata stages: the data of every chunk is generated right before its
+    // spng_set_* call, nothing is generated if the IHDR was rejected
     struct spng_plte plte;
-    if (choose_to_initialize()){
-        plte.n_entries = rand() % RECOMMENDED_MAX_LENGTH;
+    if (ihdr.color_type == SPNG_COLOR_TYPE_INDEXED || choose_to_initialize(rng)){
+        plte.n_entries = rng_below(rng, RECOMMENDED_MAX_LENGTH);
+
+        // Indexed images are not encoded without a PLTE, give one entry to every index
+        if (ihdr.color_type == SPNG_COLOR_TYPE_INDEXED) plte.n_entries = 1u << ihdr.bit_depth;
         for (uint32_t i = 0; i < plte.n_entries; i++) {
-            plte.entries[i].red = rand() % UINT8_MAX;
-            plte.entries[i].green = rand() % UINT8_MAX;
-            plte.entries[i].blue = rand() % UINT8_MAX;
-            plte.entries[i].alpha = rand() % UINT8_MAX;
+            plte.entries[i].red = rng_below(rng, UINT8_MAX);
+            plte.entries[i].green = rng_below(rng, UINT8_MAX);
+            plte.entries[i].blue = rng_below(rng, UINT8_MAX);
+            plte.entries[i].alpha = rng_below(rng, UINT8_MAX);
         }
     }
-    
+    test(spng_set_plte(ctx, &plte));
 
     struct spng_trns trns;
-    if (choose_to_initialize()){
-        trns.gray = rand() % UINT16_MAX;
-        trns.red = rand() % UINT16_MAX;
-        trns.green = rand() % UINT16_MAX;
-        trns.blue = rand() % UINT16_MAX;
-        trns.n_type3_entries = rand() % UINT32_MAX;
-        int entries = rand() % 256;
+    if (choose_to_initialize(rng)){
+        trns.gray = rng_below(rng, UINT16_MAX);
+        trns.red = rng_below(rng, UINT16_MAX);
+        trns.green = rng_below(rng, UINT16_MAX);
+        trns.blue = rng_below(rng, UINT16_MAX);
+        trns.n_type3_entries = rng_below(rng, UINT32_MAX);
+        int entries = rng_below(rng, 256);
         for (int i = 0; i < entries; i++) {
-            trns.type3_alpha[i] = rand() % UINT8_MAX;
+            trns.type3_alpha[i] = rng_below(rng, UINT8_MAX);
         }
     }
-    
+    test(spng_set_trns(ctx, &trns));
 
     struct spng_chrm chrm;
-    if (choose_to_initialize()){
+    if (choose_to_initialize(rng)){
         // random double values
-        chrm.white_point_x = rand() % 65536 / 1000.0;
-        chrm.white_point_y = rand() % 65536 / 1000.0;
-        chrm.red_x = rand() % 65536 / 1000.0;
-        chrm.red_y = rand() % 65536 / 1000.0;
-        chrm.green_x = rand() % 65536 / 1000.0;
-        chrm.green_y = rand() % 65536 / 1000.0;
-        chrm.blue_x = rand() % 65536 / 1000.0;
-        chrm.blue_y = rand() % 65536 / 1000.0;
+        chrm.white_point_x = rng_below(rng, 65536) / 1000.0;
+        chrm.white_point_y = rng_below(rng, 65536) / 1000.0;
+        chrm.red_x = rng_below(rng, 65536) / 1000.0;
+        chrm.red_y = rng_below(rng, 65536) / 1000.0;
+        chrm.green_x = rng_below(rng, 65536) / 1000.0;
+        chrm.green_y = rng_below(rng, 65536) / 1000.0;
+        chrm.blue_x = rng_below(rng, 65536) / 1000.0;
+        chrm.blue_y = rng_below(rng, 65536) / 1000.0;
     }
-    
+    test(spng_set_chrm(ctx, &chrm));
 
     struct spng_chrm_int chrm_int;
     // random uint32_t values
-    if(choose_to_initialize()){
-        chrm_int.white_point_x = rand() % UINT32_MAX;
-        chrm_int.white_point_y = rand() % UINT32_MAX;
-        chrm_int.red_x = rand() % UINT32_MAX;
-        chrm_int.red_y = rand() % UINT32_MAX;
-        chrm_int.green_x = rand() % UINT32_MAX;
-        chrm_int.green_y = rand() % UINT32_MAX;
-        chrm_int.blue_x = rand() % UINT32_MAX;
-        chrm_int.blue_y = rand() % UINT32_MAX;
+    if(choose_to_initialize(rng)){
+        chrm_int.white_point_x = rng_below(rng, UINT32_MAX);
+        chrm_int.white_point_y = rng_below(rng, UINT32_MAX);
+        chrm_int.red_x = rng_below(rng, UINT32_MAX);
+        chrm_int.red_y = rng_below(rng, UINT32_MAX);
+        chrm_int.green_x = rng_below(rng, UINT32_MAX);
+        chrm_int.green_y = rng_below(rng, UINT32_MAX);
+        chrm_int.blue_x = rng_below(rng, UINT32_MAX);
+        chrm_int.blue_y = rng_below(rng, UINT32_MAX);
     }
-    
+    test(spng_set_chrm_int(ctx, &chrm_int));
 
     double gama;
     uint32_t gama_int;
@@ -1113,27 +3463,28 @@ int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config)
         gama_int = (uint32_t)(config.gamma * 100);
     }
     else {
-        gama = rand() % 65536 / 10000.0;
-        gama_int = rand() % UINT32_MAX;
+        gama = rng_below(rng, 65536) / 10000.0;
+        gama_int = rng_below(rng, UINT32_MAX);
     }
-    
-    
+    test(spng_set_gama(ctx, gama));
+    test(spng_set_gama_int(ctx, gama_int));
 
     struct spng_iccp iccp;
     // Initialize or not at random (more probble to initialize)
-    if (choose_to_initialize()){
-        int length = rand() % 80;
+    if (choose_to_initialize(rng)){
+        int length = rng_below(rng, 80);
         for (int i = 0; i < length; i++) {
-            iccp.profile_name[i] = rand() % 256;
+            iccp.profile_name[i] = rng_below(rng, 256);
         }
         iccp.profile_name[length] = '\0';
-        iccp.profile = get_random_string(rand() % RECOMMENDED_MAX_LENGTH); // random string (at most 1000 chars)
-        iccp.profile_len = rand() % RECOMMENDED_MAX_LENGTH; // random length that can be larger than the actual string
+        iccp.profile = get_random_string(rng, arena, rng_below(rng, RECOMMENDED_MAX_LENGTH)); // random string (at most 1000 chars)
+        iccp.profile_len = rng_below(rng, RECOMMENDED_MAX_LENGTH); // random length that can be larger than the actual string
     }
+    test(spng_set_iccp(ctx, &iccp));
 
     struct spng_sbit sbit;
-    if(choose_to_initialize()){
-        if (select_random_with_probability(0.9)){
+    if(choose_to_initialize(rng)){
+        if (select_random_with_probability(rng, 0.9)){
             sbit.grayscale_bits = config.significant_bits;
             sbit.red_bits = config.significant_bits;
             sbit.green_bits = config.significant_bits;
@@ -1141,40 +3492,42 @@ int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config)
             sbit.alpha_bits = config.significant_bits;
         }
         else {
-            sbit.grayscale_bits = rand() % UINT8_MAX;
-            sbit.red_bits = rand() % UINT8_MAX;
-            sbit.green_bits = rand() % UINT8_MAX;
-            sbit.blue_bits = rand() % UINT8_MAX;
-            sbit.alpha_bits = rand() % UINT8_MAX;
+            sbit.grayscale_bits = rng_below(rng, UINT8_MAX);
+            sbit.red_bits = rng_below(rng, UINT8_MAX);
+            sbit.green_bits = rng_below(rng, UINT8_MAX);
+            sbit.blue_bits = rng_below(rng, UINT8_MAX);
+            sbit.alpha_bits = rng_below(rng, UINT8_MAX);
         }
     }
-    
-    
-    uint8_t srgb_rendering_intent = rand() % UINT8_MAX;
+    test(spng_set_sbit(ctx, &sbit));
+
+    uint8_t srgb_rendering_intent = rng_below(rng, UINT8_MAX);
+    test(spng_set_srgb(ctx, srgb_rendering_intent));
 
     // Initializing spng_text text
-    int n_text = rand() % 5;
-    struct spng_text text[n_text];
-    if (choose_to_initialize()){
+    int n_text = rng_below(rng, 5);
+    struct spng_text text[4];
+    if (choose_to_initialize(rng)){
         for (int i = 0; i < n_text; i++) {
-            int length = rand() % 80;
+            int length = rng_below(rng, 80);
             for (int j = 0; j < length; j++) {
-                text[i].keyword[j] = rand() % 256;
+                text[i].keyword[j] = rng_below(rng, 256);
             }
             text[i].keyword[length] = '\0';
-            text[i].text = get_random_string(rand() % RECOMMENDED_MAX_LENGTH); // random string (at most 1000 chars)
-            text[i].length = rand() % RECOMMENDED_MAX_LENGTH; // random length that can be larger than the actual string
-            text[i].type = rand() % 5; // 1 to 3 are valid types, 0 and 4 are invalid
-            text[i].compression_flag = rand() % UINT8_MAX;
-            text[i].language_tag = get_random_string(rand() % RECOMMENDED_MAX_LENGTH);
-            text[i].translated_keyword = get_random_string(rand() % RECOMMENDED_MAX_LENGTH);
+            text[i].text = get_random_string(rng, arena, rng_below(rng, RECOMMENDED_MAX_LENGTH)); // random string (at most 1000 chars)
+            text[i].length = rng_below(rng, RECOMMENDED_MAX_LENGTH); // random length that can be larger than the actual string
+            text[i].type = rng_below(rng, 5); // 1 to 3 are valid types, 0 and 4 are invalid
+            text[i].compression_flag = rng_below(rng, UINT8_MAX);
+            text[i].language_tag = get_random_string(rng, arena, rng_below(rng, RECOMMENDED_MAX_LENGTH));
+            text[i].translated_keyword = get_random_string(rng, arena, rng_below(rng, RECOMMENDED_MAX_LENGTH));
         }
     }
+    test(spng_set_text(ctx, text, n_text));
 
     struct spng_bkgd bkgd;
-    if (choose_to_initialize()){
+    if (choose_to_initialize(rng)){
         if (config.background == GRAY){
-            bkgd.gray = rand() % UINT16_MAX;
+            bkgd.gray = rng_below(rng, UINT16_MAX);
         }
         else if (config.background == BLACK){
             bkgd.red = 0;
@@ -1190,243 +3543,132 @@ int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config)
             bkgd.red = 255;
             bkgd.green = 255;
             bkgd.blue = 0;
-        } 
-        else if (random_choice()){
-            bkgd.red = rand() % UINT16_MAX;
-            bkgd.green = rand() % UINT16_MAX;
-            bkgd.blue = rand() % UINT16_MAX;
         }
-        else if (random_choice()){
-            bkgd.gray = rand() % UINT16_MAX;
+        else if (random_choice(rng)){
+            bkgd.red = rng_below(rng, UINT16_MAX);
+            bkgd.green = rng_below(rng, UINT16_MAX);
+            bkgd.blue = rng_below(rng, UINT16_MAX);
+        }
+        else if (random_choice(rng)){
+            bkgd.gray = rng_below(rng, UINT16_MAX);
         }
         else{
-            bkgd.plte_index = rand() % UINT16_MAX;
+            bkgd.plte_index = rng_below(rng, UINT16_MAX);
         }
     }
+    test(spng_set_bkgd(ctx, &bkgd));
 
     struct spng_hist hist;
-    if (choose_to_initialize()){
+    if (choose_to_initialize(rng)){
         if (config.testFeature == HISTOGRAM && config.histogram_colors == 15) {
             for (int i = 0; i < 15; i++) {
-                hist.frequency[i] = rand() % UINT16_MAX;
+                hist.frequency[i] = rng_below(rng, UINT16_MAX);
             }
             for (int i = 15; i < 256; i++) {
                 hist.frequency[i] = 0;
             }
         } else {
             for (int i = 0; i < 256; i++) {
-                hist.frequency[i] = rand() % UINT16_MAX;
+                hist.frequency[i] = rng_below(rng, UINT16_MAX);
             }
         }
     }
+    test(spng_set_hist(ctx, &hist));
 
     struct spng_phys phys;
-    if(choose_to_initialize()){
+    if(choose_to_initialize(rng)){
         if(config.testFeature == PHYSICAL_PIXELS){
             phys.ppu_x = config.ppu_x;
             phys.ppu_y = config.ppu_y;
             phys.unit_specifier = config.unit_specifier;
         }
         else{
-            phys.ppu_x = rand() % UINT32_MAX;
-            phys.ppu_y = rand() % UINT32_MAX;
-            phys.unit_specifier = rand() % 3; // 0, 1, 2 (invalid)
+            phys.ppu_x = rng_below(rng, UINT32_MAX);
+            phys.ppu_y = rng_below(rng, UINT32_MAX);
+            phys.unit_specifier = rng_below(rng, 3); // 0, 1, 2 (invalid)
         }
     }
+    test(spng_set_phys(ctx, &phys));
 
-    uint32_t n_splt = rand() % 5;
-    struct spng_splt splt[n_splt];
-    if(choose_to_initialize()){
+    uint32_t n_splt = rng_below(rng, 5);
+    struct spng_splt splt[4];
+    if(choose_to_initialize(rng)){
         for (uint32_t i = 0; i < n_splt; i++) {
-            int length = rand() % 80;
+            int length = rng_below(rng, 80);
             for (int j = 0; j < length; j++) {
-                splt[i].name[j] = rand() % 256;
+                splt[i].name[j] = rng_below(rng, 256);
             }
             splt[i].name[length] = '\0';
-            splt[i].sample_depth = rand() % 3 * 8; // 0, 8, 16 which 0 is invalid
-            splt[i].n_entries = rand() % RECOMMENDED_MAX_LENGTH;
-            splt[i].entries = (struct spng_splt_entry*)malloc(splt[i].n_entries * sizeof(struct spng_splt_entry));
+            splt[i].sample_depth = rng_below(rng, 3) * 8; // 0, 8, 16 which 0 is invalid
+            splt[i].n_entries = rng_below(rng, RECOMMENDED_MAX_LENGTH);
+            splt[i].entries = (struct spng_splt_entry*)arena_alloc(arena, splt[i].n_entries * sizeof(struct spng_splt_entry));
+            if(splt[i].entries == NULL) splt[i].n_entries = 0;
             for (uint32_t j = 0; j < splt[i].n_entries; j++) {
-                splt[i].entries[j].red = rand() % UINT16_MAX;
-                splt[i].entries[j].green = rand() % UINT16_MAX;
-                splt[i].entries[j].blue = rand() % UINT16_MAX;
-                splt[i].entries[j].alpha = rand() % UINT16_MAX;
-                splt[i].entries[j].frequency = rand() % UINT16_MAX;
+                splt[i].entries[j].red = rng_below(rng, UINT16_MAX);
+                splt[i].entries[j].green = rng_below(rng, UINT16_MAX);
+                splt[i].entries[j].blue = rng_below(rng, UINT16_MAX);
+                splt[i].entries[j].alpha = rng_below(rng, UINT16_MAX);
+                splt[i].entries[j].frequency = rng_below(rng, UINT16_MAX);
             }
         }
     }
+    test(spng_set_splt(ctx, splt, n_splt));
 
     struct spng_time time;
-    if(choose_to_initialize()){
+    if(choose_to_initialize(rng)){
         if(config.testFeature == TIME){
             time.year = config.time.year;
             time.month = config.time.month;
             time.day = config.time.day;
         }
         else{
-            time.year = rand() % UINT16_MAX;
-            time.month = rand() % UINT8_MAX;
-            time.day = rand() % UINT8_MAX;
+            time.year = rng_below(rng, UINT16_MAX);
+            time.month = rng_below(rng, UINT8_MAX);
+            time.day = rng_below(rng, UINT8_MAX);
         }
-        time.hour = rand() % UINT8_MAX;
-        time.minute = rand() % UINT8_MAX;
-        time.second = rand() % UINT8_MAX;
+        time.hour = rng_below(rng, UINT8_MAX);
+        time.minute = rng_below(rng, UINT8_MAX);
+        time.second = rng_below(rng, UINT8_MAX);
     }
+    test(spng_set_time(ctx, &time));
 
-    uint32_t n_chunks = rand() % 5;
-    struct spng_unknown_chunk chunks[n_chunks];
-    if(choose_to_initialize()){
+    uint32_t n_chunks = rng_below(rng, 5);
+    struct spng_unknown_chunk chunks[4];
+    if(choose_to_initialize(rng)){
         for (uint32_t i = 0; i < n_chunks; i++) {
-            int length = rand() % 4;
+            int length = rng_below(rng, 4);
             for (int j = 0; j < length; j++) {
-                chunks[i].type[j] = rand() % 256;
+                chunks[i].type[j] = rng_below(rng, 256);
             }
             chunks[i].type[length] = '\0';
-            chunks[i].length = rand() % RECOMMENDED_MAX_LENGTH;
-            chunks[i].data = get_random_string(rand() % RECOMMENDED_MAX_LENGTH);
+            chunks[i].length = rng_below(rng, RECOMMENDED_MAX_LENGTH);
+            chunks[i].data = get_random_string(rng, arena, rng_below(rng, RECOMMENDED_MAX_LENGTH));
             // location can be 0 (invalid), 1, 2 or 8
-            int value = rand() % 4;
+            int value = rng_below(rng, 4);
             if (value == 3) value = 8;
             chunks[i].location = value;
 
         }
     }
+    test(spng_set_unknown_chunks(ctx, chunks, n_chunks));
 
     struct spng_offs offs;
-    if(choose_to_initialize()){
-        offs.unit_specifier = rand() % 3; // 0, 1, 2 (invalid)
-        offs.x = rand() % UINT32_MAX;
-        offs.y = rand() % UINT32_MAX;
+    if(choose_to_initialize(rng)){
+        offs.unit_specifier = rng_below(rng, 3); // 0, 1, 2 (invalid)
+        offs.x = rng_below(rng, UINT32_MAX);
+        offs.y = rng_below(rng, UINT32_MAX);
     }
+    test(spng_set_offs(ctx, &offs));
 
     struct spng_exif exif;
-    if(choose_to_initialize()){
-        exif.data = get_random_string(rand() % RECOMMENDED_MAX_LENGTH);
-        exif.length = rand() % RECOMMENDED_MAX_LENGTH;
-    }
-
-    struct buf_state state;
-    state.data = NULL;
-    state.bytes_left = rand() % SIZE_MAX;
-
-    enum spng_option options_list[] = {
-        SPNG_KEEP_UNKNOWN_CHUNKS, // true, false
-        SPNG_IMG_COMPRESSION_LEVEL, // defaul -1, 0-9
-        SPNG_IMG_WINDOW_BITS, // default 15, 8-15
-        SPNG_IMG_MEM_LEVEL, // default 8, 1-9
-        SPNG_IMG_COMPRESSION_STRATEGY, // default 0, 0-4
-        SPNG_TEXT_COMPRESSION_LEVEL, // default -1, 0-9
-        SPNG_TEXT_WINDOW_BITS, // default 15, 8-15
-        SPNG_TEXT_MEM_LEVEL, // default 8, 1-9
-        SPNG_TEXT_COMPRESSION_STRATEGY, // default 0, 0-4
-        SPNG_FILTER_CHOICE, // default 0, 0-4
-        SPNG_CHUNK_COUNT_LIMIT, // default 0, 0-UINT32_MAX
-        SPNG_ENCODE_TO_BUFFER // true, false
-    };
-    int TOTAL_OPTIONS = sizeof(options_list) / sizeof(enum spng_option);
-
-    // Set up random configuration
-    int stream = rand() % 2;
-    int get_buffer = rand() % 2;
-    int progressive = rand() % 2;
-    int fmt = get_fmt_from_config(&config);
-
-    int num_options = rand() % TOTAL_OPTIONS;
-    int chosen_options[num_options+1];
-    int chosen_values[num_options+1];
-    choose_random_options(options_list, TOTAL_OPTIONS, num_options, chosen_options, chosen_values);
-
-    // Print configuration
-    printf("Configuration:\n");
-    printf(" - stream: %d\n", stream);
-    printf(" - get_buffer: %d\n", get_buffer);
-    printf(" - progressive: %d\n", progressive);
-    printf(" - fmt: %d\n", fmt);
-    printf(" - num_options: %d\n", num_options);
-
-    for(int i = 0; i < num_options; i++){
-        printf(" - Option %d, Value %d\n", chosen_options[i], chosen_values[i]);
-    }
-    
-    // end Initialization
-
-    // print version
-    printf("libspng version: %s\n", spng_version_string());
-
-    // Test spng_ctx_new
-    spng_ctx *ctx = spng_ctx_new(SPNG_CTX_ENCODER);
-    if(ctx == NULL) goto err;
-
-    test(spng_set_image_limits(ctx, 200000, 200000));
-
-    int limits = 4 * 1000 * 1000;
-    test(spng_set_chunk_limits(ctx, limits, limits * 2));
-    
-    spng_set_option(ctx, SPNG_IMG_COMPRESSION_LEVEL, 1);
-
-    if(stream){
-        test(spng_set_png_stream(ctx, stream_write_fn, &state));
-    }
-    else{
-        test(spng_set_option(ctx, SPNG_ENCODE_TO_BUFFER, 1));
-    } 
-
-    if(fn_ret) goto err;
-
-    for(int i = 0; i < num_options; i++){
-        test(spng_set_option(ctx, chosen_options[i], chosen_values[i]));
+    if(choose_to_initialize(rng)){
+        exif.data = get_random_string(rng, arena, rng_below(rng, RECOMMENDED_MAX_LENGTH));
+        exif.length = rng_below(rng, RECOMMENDED_MAX_LENGTH);
     }
-
-    test(spng_set_ihdr(ctx, &ihdr));
-    if(fn_ret) goto err;
-
-    test(spng_set_plte(ctx, &plte));
-    test(spng_set_trns(ctx, &trns));
-    test(spng_set_chrm(ctx, &chrm));
-    test(spng_set_chrm_int(ctx, &chrm_int));
-    test(spng_set_gama(ctx, gama));
-    test(spng_set_gama_int(ctx, gama_int));
-    test(spng_set_iccp(ctx, &iccp));
-    test(spng_set_sbit(ctx, &sbit));
-    test(spng_set_srgb(ctx, srgb_rendering_intent));
-    test(spng_set_text(ctx, text, n_text));
-    test(spng_set_bkgd(ctx, &bkgd));
-    test(spng_set_hist(ctx, &hist));
-    test(spng_set_phys(ctx, &phys));
-    test(spng_set_splt(ctx, splt, n_splt));
-    test(spng_set_time(ctx, &time));
-    test(spng_set_unknown_chunks(ctx, chunks, n_chunks));
-    test(spng_set_offs(ctx, &offs));
-    
     // ERROR FOUND
     // Compilation with -Onumber causes segmentation fault if there is no exif data
     // for some configuration it throw segmentation fault even if there is exif data
     test(spng_set_exif(ctx, &exif));
-    
-
-    // Test colorspace
-    switch(ihdr.color_type)
-    {
-        case SPNG_COLOR_TYPE_GRAYSCALE:
-            pixel_bits = ihdr.bit_depth;
-            break;
-        case SPNG_COLOR_TYPE_INDEXED:
-            pixel_bits = ihdr.bit_depth;
-            break;
-        case SPNG_COLOR_TYPE_TRUECOLOR:
-            pixel_bits = ihdr.bit_depth * 3;
-            break;
-        case SPNG_COLOR_TYPE_GRAYSCALE_ALPHA:
-            pixel_bits = ihdr.bit_depth * 2;
-            break;
-        case SPNG_COLOR_TYPE_TRUECOLOR_ALPHA:
-            pixel_bits = ihdr.bit_depth * 4;
-            break;
-        default: goto err;
-    }
-    img_size = ihdr.width * pixel_bits + 7;
-    img_size /= 8;
-    img_size *= ihdr.height;
 
     if(img_size > size) goto err;
     if(img_size > 80000000) goto err;
@@ -1448,11 +3690,15 @@ int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config)
         size_t ioffset, img_width = img_size / ihdr.height;
         struct spng_row_info ri = {0};
 
+        unsigned int rows_idx = ring_call_begin("spng_encode_row loop");
+        uint64_t rows_start = profile_begin();
         do
         {
             if(spng_get_row_info(ctx, &ri)) break;
             ioffset = ri.row_num * img_width;
         }while(!spng_encode_row(ctx, img + ioffset, img_size));
+        profile_end("spng_encode_row loop", rows_start);
+        ring_call_end(rows_idx, 0);
     }
     else{
         test(spng_encode_image(ctx, img, img_size, fmt, SPNG_ENCODE_FINALIZE));
@@ -1461,124 +3707,34 @@ int fuzz_spng_write(const uint8_t* data, size_t size, PNGConfig config)
 
     if(get_buffer)
     {
+        uint64_t buffer_start = profile_begin();
         png = spng_get_png_buffer(ctx, &png_size, &fn_ret);
+        profile_end("spng_get_png_buffer", buffer_start);
 
         // These are potential vulnerabilities
         if((png && !png_size) || (!png && png_size) || (fn_ret && (png || png_size))){
-
-            // Test spng_ctx_free
-            if(ctx != NULL){
-                printf("Testing spng_ctx_free...");
-                spng_ctx_free(ctx);
-                printf("OK\n");
-            }
-            
-            // free splt entries    
-            for(uint32_t i = 0; i < n_splt; i++)
-            {
-                if(splt[i].entries != NULL) free(splt[i].entries);
-            }
-
-            // free iccp profile
-            if(iccp.profile != NULL) free(iccp.profile);
-
-            // free text
-            for(int i = 0; i < n_text; i++)
-            {
-                if(text[i].text != NULL) free(text[i].text);
-                if(text[i].language_tag != NULL) free(text[i].language_tag);
-                if(text[i].translated_keyword != NULL) free(text[i].translated_keyword);
-            }
-
-            // free exif data
-            if(exif.data != NULL) free(exif.data);
-
-            // free unknown chunks
-            for(uint32_t i = 0; i < n_chunks; i++)
-            {
-                if(chunks[i].data != NULL) free(chunks[i].data);
-            }
-
-            // end spng_ctx_free
-            if(png != NULL) free(png);
-            return 1;
+            ret = 1;
         }
     }
 
-    // Test spng_ctx_free    
-    if(ctx != NULL){
-        printf("Testing spng_ctx_free...");
-        spng_ctx_free(ctx);
-        printf("OK\n");
-    } 
-    // end spng_ctx_free
-
-    // free splt entries    
-    for(uint32_t i = 0; i < n_splt; i++)
-    {
-        if(splt[i].entries != NULL) free(splt[i].entries);
-    }
-
-    // free iccp profile
-    if(iccp.profile != NULL) free(iccp.profile);
-
-    // free text
-    for(int i = 0; i < n_text; i++)
-    {
-        if(text[i].text != NULL) free(text[i].text);
-        if(text[i].language_tag != NULL) free(text[i].language_tag);
-        if(text[i].translated_keyword != NULL) free(text[i].translated_keyword);
-    }
-
-    // free exif data
-    if(exif.data != NULL) free(exif.data);
-
-    // free unknown chunks
-    for(uint32_t i = 0; i < n_chunks; i++)
-    {
-        if(chunks[i].data != NULL) free(chunks[i].data);
-    }
-
-    printf("Finished\n");
-    if(png != NULL) free(png);
-    return 0;
+    goto cleanup;
 
 err:
+    failed = 1;
+
+cleanup:
     // Test spng_ctx_free    
     if(ctx != NULL){
-        printf("Testing spng_ctx_free...");
-        spng_ctx_free(ctx);
-        printf("OK\n");
+        test_void(spng_ctx_free(ctx));
     } 
+    // end spng_ctx_free
 
-    // free splt entries    
-    for(uint32_t i = 0; i < n_splt; i++)
-    {
-        if(splt[i].entries != NULL) free(splt[i].entries);
-    }
-
-    // free iccp profile
-    if(iccp.profile != NULL) free(iccp.profile);
-
-    // free text
-    for(int i = 0; i < n_text; i++)
-    {
-        if(text[i].text != NULL) free(text[i].text);
-        if(text[i].language_tag != NULL) free(text[i].language_tag);
-        if(text[i].translated_keyword != NULL) free(text[i].translated_keyword);
-    }
-
-    // free exif data
-    if(exif.data != NULL) free(exif.data);
+    // Releases the iccp profile, text strings, splt entries, unknown chunks and exif data
+    arena_reset(arena);
 
-    // free unknown chunks
-    for(uint32_t i = 0; i < n_chunks; i++)
-    {
-        if(chunks[i].data != NULL) free(chunks[i].data);
-    }
+    if(failed) log_trace("Finished with error\n");
+    else log_trace("Finished\n");
 
-    // end spng_ctx_free
-    printf("Finished with error\n");
-    if(png != NULL) free(png);
-    return 0;
+    if(png != NULL) harness_png_free(png);
+    return ret;
 }
\ No newline at end of file
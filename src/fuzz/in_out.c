@@ -2,6 +2,27 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// write() may write fewer bytes than asked, loop until everything is written
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -16,23 +37,61 @@ int main(int argc, char *argv[])
         write(STDOUT_FILENO, "Open failed\n", 12);
         return 1;
     }
-    FILE *write_file = fopen(argv[2], "w");
-    if (write_file == NULL)
+    int fd_write = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_write < 0)
     {
         write(STDOUT_FILENO, "Open failed\n", 12);
         return 1;
     }
 
-    long len = lseek(fd_read, 0, SEEK_END);
-    char *buf = (char *)malloc(len);
-    lseek(fd_read, 0, SEEK_SET);
+    // Regular files are mapped and written out from the mapping
+    struct stat st;
+    if (fstat(fd_read, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        char *map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd_read, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
 
-    read(fd_read, buf, len);
+            int ret = 0;
+            if (write_all(fd_write, map, st.st_size) < 0)
+            {
+                write(STDOUT_FILENO, "Write failed\n", 13);
+                ret = 1;
+            }
 
-    fwrite(buf, 1, len, write_file);
+            munmap(map, st.st_size);
+            close(fd_read);
+            close(fd_write);
+            return ret;
+        }
+    }
+
+    // Pipes and failed mappings: read() may return fewer bytes than asked, loop until EOF
+    char buf[64 * 1024];
+    int ret = 0;
+    for (;;)
+    {
+        ssize_t len = read(fd_read, buf, sizeof(buf));
+        if (len == 0)
+            break;
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            write(STDOUT_FILENO, "Read failed\n", 12);
+            ret = 1;
+            break;
+        }
+        if (write_all(fd_write, buf, len) < 0)
+        {
+            write(STDOUT_FILENO, "Write failed\n", 13);
+            ret = 1;
+            break;
+        }
+    }
 
-    free(buf);
     close(fd_read);
-    fclose(write_file);
-    return 0;
+    close(fd_write);
+    return ret;
 }
\ No newline at end of file
@@ -0,0 +1,720 @@
+// Multi-threaded in-process fuzzer: N worker threads mutate the seed images in
+// memory and run them through the generic_test harness, without creating any process.
+// Every thread has its own PRNG, mutation buffer and harness state (HARNESS_THREADS),
+// and libspng contexts are created per test case, so the workers share nothing but
+// the read-only seeds and the statistics counters.
+//
+// Usage: ./fuzz/parallel_fuzz.fuzz [-j threads] [-t seconds] [-n executions]
+//                                  [-s seed] [-d deadline_ms] [-o crash_dir] [seed_dir]
+//
+// The mutant of (seed image, mutation number) only depends on the campaign seed (-s),
+// so a crash is reproduced by the file saved in crash_dir or by running the campaign
+// again with the same seed. A test case running past the deadline (-d) is saved as a
+// hang in crash_dir and stops the campaign with status 124, as the watchdog of the
+// single-threaded builds does.
+//
+// The campaign runs in rounds of ROUND_MUTATIONS mutations of every seed, split into
+// tasks of TASK_MUTATIONS mutations of one seed. Every worker has a deque of tasks:
+// it runs its own tasks newest first and, once it runs dry, steals the oldest half
+// of another worker's deque, so the workers given expensive seeds (e.g. interlaced
+// 16-bit images) don't leave the others idle. The next round starts as soon as a
+// worker finds nothing left to steal.
+
+#define HARNESS_THREADS 1
+#define GENERIC_TEST_NO_MAIN
+
+#include "generic_test.c"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// number of mutations stacked on a seed for one test case, at most
+#define MAX_STACKED_MUTATIONS 8
+
+// bytes a mutant can grow past its seed
+#define MUTANT_GROWTH (64 * 1024)
+
+// executions counted by a worker before it adds them to the shared counters
+#define STATS_FLUSH_INTERVAL 256
+
+// mutations of one seed run by a task
+#define TASK_MUTATIONS 32
+
+// mutations of every seed in a round of the campaign
+#define ROUND_MUTATIONS 256
+
+// most tasks taken by one steal
+#define STEAL_MAX 64
+
+// default deadline of a test case in milliseconds (-d), checked by the main thread
+#define DEFAULT_DEADLINE_MS 1000
+
+// size of the signal stack of every worker, for the crash handler on a stack overflow
+#define WORKER_ALT_STACK_SIZE (64 * 1024)
+
+/// @brief Seed image loaded in memory, read-only once the workers start
+struct seed {
+    char path[4096];
+    char code[256]; // file code of the write configuration (get_file_code)
+    struct input_file input;
+};
+
+/// @brief Unit of work of the scheduler: mutations [first, end) of a seed
+struct task {
+    int seed;
+    unsigned long first;
+    unsigned long end;
+};
+
+/// @brief Tasks of a worker: the owner pushes and pops at the bottom (newest),
+/// the other workers steal from the top (oldest)
+struct task_deque {
+    pthread_mutex_t lock;
+    struct task *tasks;
+    size_t capacity;
+    size_t top; // index of the oldest task
+    size_t bottom; // index past the newest task
+};
+
+struct campaign;
+
+/// @brief Worker thread and its deque
+struct worker {
+    struct campaign *campaign;
+    int id;
+    struct task_deque deque;
+    pthread_t thread;
+    unsigned long execs; // read once the worker has exited
+    unsigned long steals;
+    atomic_ullong case_start; // CLOCK_MONOTONIC ns when the running test case started, 0 between them
+    atomic_int hang_signaled;
+};
+
+/// @brief Campaign settings and shared state
+struct campaign {
+    struct seed *seeds;
+    int num_seeds;
+    size_t max_seed_size;
+    uint64_t rng_seed;
+    unsigned long mutations_per_seed; // 0 for no limit
+
+    struct worker *workers;
+    int num_workers;
+
+    atomic_ulong next_round;
+    atomic_int running; // workers not exited yet
+    atomic_ulong execs;
+    atomic_ulong anomalies; // test cases failing a harness check (inconsistent libspng output)
+    atomic_int stop;
+    long deadline_ms;
+};
+
+/// @brief Test case being run by the calling worker, saved if it crashes
+struct current_case {
+    const uint8_t *data;
+    size_t size;
+    const char *seed_name;
+    unsigned long mutation;
+};
+
+static _Thread_local struct current_case current_case = {NULL, 0, NULL, 0};
+static const char *crash_dir = ".";
+
+/////////////////////////////////////////////
+// MUTATOR:
+/////////////////////////////////////////////
+
+static const uint8_t interesting_8[] = {0x00, 0x01, 0x7f, 0x80, 0xff};
+static const uint32_t interesting_32[] = {0x00000000, 0x00000001, 0x0000ffff, 0x7fffffff,
+                                          0x80000000, 0xffffffff, 0x00010000, 0x00030d40};
+
+/// @brief Applies 1 to MAX_STACKED_MUTATIONS random mutations to buf
+/// @param size - bytes of buf in use, at least 1
+/// @param capacity - bytes available in buf
+/// @return - new size of the mutant, at least 1
+static size_t mutate(struct fuzz_rng *rng, uint8_t *buf, size_t size, size_t capacity)
+{
+    uint32_t count = 1 + rng_below(rng, MAX_STACKED_MUTATIONS);
+
+    for(uint32_t i = 0; i < count; i++)
+    {
+        size_t pos = rng_below(rng, (uint32_t)size);
+        size_t len = 1 + rng_below(rng, (uint32_t)(size - pos < 64 ? size - pos : 64));
+
+        switch(rng_below(rng, 7))
+        {
+        case 0: // flip a bit
+            buf[pos] ^= (uint8_t)(1u << rng_below(rng, 8));
+            break;
+        case 1: // random byte
+            buf[pos] = (uint8_t)rng_next(rng);
+            break;
+        case 2: // interesting byte
+            buf[pos] = interesting_8[rng_below(rng, sizeof(interesting_8))];
+            break;
+        case 3: // interesting big-endian word (lengths, dimensions, CRCs)
+            if(size - pos >= 4)
+            {
+                uint32_t value = interesting_32[rng_below(rng, sizeof(interesting_32) / sizeof(uint32_t))];
+                buf[pos] = (uint8_t)(value >> 24);
+                buf[pos + 1] = (uint8_t)(value >> 16);
+                buf[pos + 2] = (uint8_t)(value >> 8);
+                buf[pos + 3] = (uint8_t)value;
+            }
+            break;
+        case 4: // delete a block
+            if(len < size)
+            {
+                memmove(buf + pos, buf + pos + len, size - pos - len);
+                size -= len;
+            }
+            break;
+        case 5: // duplicate a block
+            if(size + len <= capacity)
+            {
+                memmove(buf + pos + len, buf + pos, size - pos);
+                size += len;
+            }
+            break;
+        case 6: // copy a block over another part of the input
+        {
+            size_t dst = rng_below(rng, (uint32_t)size);
+            if(len > size - dst) len = size - dst;
+            memmove(buf + dst, buf + pos, len);
+            break;
+        }
+        }
+    }
+
+    return size;
+}
+
+/////////////////////////////////////////////
+// CRASH HANDLING:
+/////////////////////////////////////////////
+
+// Only async-signal-safe functions here, as in the crash ring dump
+
+static char *append_str(char *dst, char *end, const char *src)
+{
+    while(*src && dst < end) *dst++ = *src++;
+    return dst;
+}
+
+static char *append_ulong(char *dst, char *end, unsigned long value)
+{
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+    while(n > 0 && dst < end) *dst++ = digits[--n];
+    return dst;
+}
+
+/// @brief Saves the test case of the calling worker as
+/// <crash_dir>/<kind>-<seed>-<mutation>.png and prints the crash context
+static void save_case(const char *kind)
+{
+    if(current_case.data == NULL) return;
+
+    char path[4096];
+    char *end = path + sizeof(path) - 1;
+    char *p = append_str(path, end, crash_dir);
+    p = append_str(p, end, "/");
+    p = append_str(p, end, kind);
+    p = append_str(p, end, "-");
+    p = append_str(p, end, current_case.seed_name);
+    p = append_str(p, end, "-");
+    p = append_ulong(p, end, current_case.mutation);
+    p = append_str(p, end, ".png");
+    *p = '\0';
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0)
+    {
+        if(write(fd, current_case.data, current_case.size) < 0) {}
+        close(fd);
+    }
+
+    ring_write_str("\n==== ");
+    ring_write_str(kind);
+    ring_write_str(", test case saved as ");
+    ring_write_str(path);
+    ring_write_str(" ====\n");
+
+#if CRASH_RING == 1
+    crash_ring_dump();
+#endif
+}
+
+static void save_current_case(void)
+{
+    save_case("crash");
+}
+
+/// @brief Sent by the main thread to a worker past the deadline: the worker saves its
+/// test case, whose crash context shows the libspng call in progress, and the campaign
+/// exits with the timeout status
+static void parallel_hang_handler(int sig)
+{
+    (void)sig;
+    save_case("hang");
+    _exit(FORK_STATUS_TIMEOUT);
+}
+
+#if HARNESS_SANITIZER == 0
+static void parallel_crash_handler(int sig)
+{
+    save_current_case();
+
+    // SA_RESETHAND restored the default action, the process dies with the signal
+    raise(sig);
+}
+#endif
+
+/// @brief Replaces the crash handling of harness_init, to save the crashing test case too
+static void parallel_crash_install(void)
+{
+    struct sigaction hang;
+    memset(&hang, 0, sizeof(hang));
+    hang.sa_handler = parallel_hang_handler;
+    hang.sa_flags = SA_ONSTACK;
+    sigemptyset(&hang.sa_mask);
+    sigaction(SIGALRM, &hang, NULL);
+
+#if HARNESS_SANITIZER == 1
+    __sanitizer_set_death_callback(save_current_case);
+#else
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = parallel_crash_handler;
+    sa.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+
+    int signals[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL};
+    for(size_t i = 0; i < sizeof(signals) / sizeof(int); i++)
+        sigaction(signals[i], &sa, NULL);
+#endif
+}
+
+/////////////////////////////////////////////
+// SCHEDULER:
+/////////////////////////////////////////////
+
+/// @brief Adds a task at the bottom of a deque
+/// @return - 0 on success, -1 if the deque can't grow
+static int deque_push(struct task_deque *deque, const struct task *task)
+{
+    int ret = 0;
+    pthread_mutex_lock(&deque->lock);
+
+    if(deque->bottom == deque->capacity)
+    {
+        // Reuse the slots freed by the steals before growing
+        size_t count = deque->bottom - deque->top;
+        memmove(deque->tasks, deque->tasks + deque->top, count * sizeof(struct task));
+        deque->top = 0;
+        deque->bottom = count;
+
+        if(count == deque->capacity)
+        {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 256;
+            struct task *tasks = (struct task*)realloc(deque->tasks, capacity * sizeof(struct task));
+            if(tasks == NULL) ret = -1;
+            else
+            {
+                deque->tasks = tasks;
+                deque->capacity = capacity;
+            }
+        }
+    }
+    if(ret == 0) deque->tasks[deque->bottom++] = *task;
+
+    pthread_mutex_unlock(&deque->lock);
+    return ret;
+}
+
+/// @brief Takes the newest task of the deque of the calling worker
+/// @return - 1 if a task was taken, 0 if the deque is empty
+static int deque_pop(struct task_deque *deque, struct task *task)
+{
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+
+    if(deque->bottom > deque->top)
+    {
+        *task = deque->tasks[--deque->bottom];
+        found = 1;
+    }
+    if(deque->bottom == deque->top) deque->top = deque->bottom = 0;
+
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/// @brief Takes the oldest half of the tasks of another deque (at most STEAL_MAX)
+/// @return - number of tasks copied to stolen
+static size_t deque_steal(struct task_deque *victim, struct task *stolen)
+{
+    pthread_mutex_lock(&victim->lock);
+
+    size_t count = (victim->bottom - victim->top + 1) / 2;
+    if(count > STEAL_MAX) count = STEAL_MAX;
+    memcpy(stolen, victim->tasks + victim->top, count * sizeof(struct task));
+    victim->top += count;
+    if(victim->bottom == victim->top) victim->top = victim->bottom = 0;
+
+    pthread_mutex_unlock(&victim->lock);
+    return count;
+}
+
+/// @brief Adds the tasks of a round to the deques of num_workers workers from first_worker on
+/// @return - 0 if the round was scheduled, -1 if the campaign is over
+static int schedule_round(struct campaign *campaign, unsigned long round, int first_worker, int num_workers)
+{
+    unsigned long first = round * ROUND_MUTATIONS;
+    unsigned long end = first + ROUND_MUTATIONS;
+    if(campaign->mutations_per_seed)
+    {
+        if(first >= campaign->mutations_per_seed) return -1;
+        if(end > campaign->mutations_per_seed) end = campaign->mutations_per_seed;
+    }
+
+    // Seed-major order: a steal from the top takes the tasks of a few seeds
+    unsigned long k = 0;
+    for(int seed = 0; seed < campaign->num_seeds; seed++)
+    {
+        for(unsigned long mutation = first; mutation < end; mutation += TASK_MUTATIONS, k++)
+        {
+            struct task task = {seed, mutation, mutation + TASK_MUTATIONS < end ? mutation + TASK_MUTATIONS : end};
+            struct worker *worker = &campaign->workers[(first_worker + k % num_workers) % campaign->num_workers];
+            if(deque_push(&worker->deque, &task)) return -1;
+        }
+    }
+
+    return 0;
+}
+
+/// @brief Gets the next task of a worker: its own, else stolen, else of a new round
+/// @return - 1 if a task was found, 0 if the campaign is over
+static int next_task(struct worker *self, struct task *task)
+{
+    struct campaign *campaign = self->campaign;
+    struct task stolen[STEAL_MAX];
+
+    for(;;)
+    {
+        if(deque_pop(&self->deque, task)) return 1;
+
+        // Victims are tried from the next worker on, so the steals are spread
+        for(int i = 1; i < campaign->num_workers; i++)
+        {
+            struct worker *victim = &campaign->workers[(self->id + i) % campaign->num_workers];
+            size_t count = deque_steal(&victim->deque, stolen);
+            if(count == 0) continue;
+
+            self->steals++;
+            *task = stolen[0];
+            for(size_t j = 1; j < count; j++) deque_push(&self->deque, &stolen[j]);
+            return 1;
+        }
+
+        // Nothing left anywhere: the round is only finishing in the tasks being run
+        unsigned long round = atomic_fetch_add(&campaign->next_round, 1);
+        if(schedule_round(campaign, round, self->id, 1)) return 0;
+    }
+}
+
+/////////////////////////////////////////////
+// WORKERS:
+/////////////////////////////////////////////
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Signals the workers whose test case runs past the deadline, from the main thread
+static void check_deadlines(struct campaign *campaign, int started)
+{
+    uint64_t deadline_ns = (uint64_t)campaign->deadline_ms * 1000000ull;
+
+    for(int i = 0; i < started; i++)
+    {
+        struct worker *worker = &campaign->workers[i];
+
+        // The clock is read after case_start: a test case started in between
+        // would otherwise be later than now and wrap the elapsed time
+        uint64_t case_start = atomic_load(&worker->case_start);
+        uint64_t now = monotonic_ns();
+        if(case_start == 0 || case_start >= now || now - case_start < deadline_ns) continue;
+
+        // Once: the worker exits the process from its handler
+        if(atomic_exchange(&worker->hang_signaled, 1) == 0) pthread_kill(worker->thread, SIGALRM);
+    }
+}
+
+/// @brief Worker thread: runs the tasks of the scheduler until the campaign stops
+static void *worker_main(void *arg)
+{
+    struct worker *self = (struct worker*)arg;
+    struct campaign *campaign = self->campaign;
+    size_t capacity = campaign->max_seed_size + MUTANT_GROWTH;
+    uint8_t *mutant = (uint8_t*)malloc(capacity);
+    unsigned long execs = 0;
+    unsigned long anomalies = 0;
+    struct task task = {0, 0, 0};
+
+#if HARNESS_SANITIZER == 0
+    // The signal stack is per thread: without its own, a worker overflowing its stack
+    // would fault again in the crash handler, with nothing saved
+    stack_t ss;
+    ss.ss_sp = malloc(WORKER_ALT_STACK_SIZE);
+    ss.ss_size = WORKER_ALT_STACK_SIZE;
+    ss.ss_flags = 0;
+    if(ss.ss_sp != NULL) sigaltstack(&ss, NULL);
+#endif
+
+    while(mutant != NULL && !atomic_load_explicit(&campaign->stop, memory_order_relaxed))
+    {
+        if(task.first == task.end && !next_task(self, &task)) break;
+
+        const struct seed *seed = &campaign->seeds[task.seed];
+        unsigned long mutation = task.first++;
+
+        // The mutant only depends on the campaign seed, the seed image and the mutation number
+        struct fuzz_rng rng;
+        rng_seed(&rng, campaign->rng_seed ^ input_hash(seed->input.data, seed->input.size) ^ (mutation * 0x9E3779B97F4A7C15ull));
+
+        ASAN_UNPOISON_MEMORY_REGION(mutant, capacity);
+        memcpy(mutant, seed->input.data, seed->input.size);
+        size_t size = mutate(&rng, mutant, seed->input.size, capacity);
+
+        // The bytes past the mutant are poisoned, so ASan reports the over-reads of the input
+        ASAN_POISON_MEMORY_REGION(mutant + size, capacity - size);
+
+        current_case.data = mutant;
+        current_case.size = size;
+        current_case.seed_name = seed->code;
+        current_case.mutation = mutation;
+
+        atomic_store(&self->case_start, monotonic_ns());
+        if(fuzz_one_input(mutant, size, seed->code)) anomalies++;
+        atomic_store(&self->case_start, 0);
+
+        self->execs++;
+        if(++execs == STATS_FLUSH_INTERVAL)
+        {
+            atomic_fetch_add_explicit(&campaign->execs, execs, memory_order_relaxed);
+            atomic_fetch_add_explicit(&campaign->anomalies, anomalies, memory_order_relaxed);
+            execs = 0;
+            anomalies = 0;
+        }
+    }
+
+    atomic_fetch_add_explicit(&campaign->execs, execs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&campaign->anomalies, anomalies, memory_order_relaxed);
+
+    current_case.data = NULL;
+    if(mutant != NULL) ASAN_UNPOISON_MEMORY_REGION(mutant, capacity);
+    free(mutant);
+    harness_thread_cleanup();
+
+#if HARNESS_SANITIZER == 0
+    if(ss.ss_sp != NULL)
+    {
+        ss.ss_flags = SS_DISABLE;
+        sigaltstack(&ss, NULL);
+        free(ss.ss_sp);
+    }
+#endif
+    atomic_fetch_sub(&campaign->running, 1);
+
+    return NULL;
+}
+
+/////////////////////////////////////////////
+// SEEDS:
+/////////////////////////////////////////////
+
+static int is_png_name(const struct dirent *entry)
+{
+    size_t len = strlen(entry->d_name);
+    return entry->d_name[0] != '.' && len > 4 && strcmp(entry->d_name + len - 4, ".png") == 0;
+}
+
+/// @brief Loads the .png files of dir, in name order
+/// @return - number of seeds loaded, 0 on error
+static int load_seeds(struct campaign *campaign, const char *dir)
+{
+    struct dirent **entries;
+    int n = scandir(dir, &entries, is_png_name, alphasort);
+    if(n <= 0) return 0;
+
+    campaign->seeds = (struct seed*)calloc(n, sizeof(struct seed));
+    campaign->num_seeds = 0;
+    campaign->max_seed_size = 0;
+
+    for(int i = 0; i < n; i++)
+    {
+        struct seed *seed = &campaign->seeds[campaign->num_seeds];
+        snprintf(seed->path, sizeof(seed->path), "%s/%s", dir, entries[i]->d_name);
+        free(entries[i]);
+
+        int fd = open(seed->path, O_RDONLY);
+        if(fd < 0) continue;
+        int ret = input_load(fd, &seed->input);
+        close(fd);
+        if(ret || seed->input.size < 1)
+        {
+            input_unload(&seed->input);
+            continue;
+        }
+
+        get_file_code(seed->path, seed->code);
+        if(seed->input.size > campaign->max_seed_size) campaign->max_seed_size = seed->input.size;
+        campaign->num_seeds++;
+    }
+    free(entries);
+
+    return campaign->num_seeds;
+}
+
+/////////////////////////////////////////////
+// MAIN:
+/////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+    struct campaign campaign;
+    memset(&campaign, 0, sizeof(campaign));
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long seconds = 60;
+    unsigned long max_execs = 0;
+    const char *seed_dir = "images";
+    campaign.rng_seed = (uint64_t)time(NULL);
+    campaign.deadline_ms = DEFAULT_DEADLINE_MS;
+
+    int opt;
+    while((opt = getopt(argc, argv, "j:t:n:s:d:o:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'j': num_threads = strtol(optarg, NULL, 10); break;
+        case 't': seconds = strtol(optarg, NULL, 10); break;
+        case 'n': max_execs = strtoul(optarg, NULL, 10); break;
+        case 's': campaign.rng_seed = strtoull(optarg, NULL, 10); break;
+        case 'd': campaign.deadline_ms = strtol(optarg, NULL, 10); break;
+        case 'o': crash_dir = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-j threads] [-t seconds] [-n executions] [-s seed] [-d deadline_ms] [-o crash_dir] [seed_dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind < argc) seed_dir = argv[optind];
+    if(num_threads < 1) num_threads = 1;
+    if(campaign.deadline_ms < 1) campaign.deadline_ms = DEFAULT_DEADLINE_MS;
+
+    harness_init();
+    parallel_crash_install();
+
+    if(load_seeds(&campaign, seed_dir) == 0)
+    {
+        fprintf(stderr, "No seed images in %s\n", seed_dir);
+        return 1;
+    }
+
+    fprintf(stderr, "Fuzzing %d seeds with %ld threads, seed %llu\n",
+            campaign.num_seeds, num_threads, (unsigned long long)campaign.rng_seed);
+
+    // -n is rounded up to the same number of mutations for every seed
+    campaign.mutations_per_seed = (max_execs + campaign.num_seeds - 1) / campaign.num_seeds;
+
+    campaign.num_workers = (int)num_threads;
+    campaign.workers = (struct worker*)calloc(num_threads, sizeof(struct worker));
+    for(int i = 0; i < campaign.num_workers; i++)
+    {
+        campaign.workers[i].campaign = &campaign;
+        campaign.workers[i].id = i;
+        pthread_mutex_init(&campaign.workers[i].deque.lock, NULL);
+    }
+
+    // The first round is spread over every deque, the next ones are scheduled on demand
+    schedule_round(&campaign, 0, 0, campaign.num_workers);
+    atomic_store(&campaign.next_round, 1);
+
+    int started = 0;
+    for(; started < campaign.num_workers; started++)
+    {
+        atomic_fetch_add(&campaign.running, 1);
+        if(pthread_create(&campaign.workers[started].thread, NULL, worker_main, &campaign.workers[started]))
+        {
+            atomic_fetch_sub(&campaign.running, 1);
+            break;
+        }
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Progress once per second, until the time or the executions are over
+    double elapsed = 0;
+    for(;;)
+    {
+        struct timespec delay = {0, 100 * 1000 * 1000};
+        for(int i = 0; i < 10 && atomic_load(&campaign.running) > 0; i++)
+        {
+            nanosleep(&delay, NULL);
+            check_deadlines(&campaign, started);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+        unsigned long execs = atomic_load(&campaign.execs);
+
+        fprintf(stderr, "\r[%.0fs] executions: %lu (%.0f/s), harness anomalies: %lu   ",
+                elapsed, execs, execs / elapsed, atomic_load(&campaign.anomalies));
+
+        if(elapsed >= seconds || atomic_load(&campaign.running) == 0) break;
+    }
+
+    atomic_store(&campaign.stop, 1);
+
+    // The workers finish their test case, one stuck in it is stopped by the deadline
+    while(atomic_load(&campaign.running) > 0)
+    {
+        struct timespec delay = {0, 10 * 1000 * 1000};
+        nanosleep(&delay, NULL);
+        check_deadlines(&campaign, started);
+    }
+    for(int i = 0; i < started; i++) pthread_join(campaign.workers[i].thread, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    unsigned long execs = atomic_load(&campaign.execs);
+    fprintf(stderr, "\nDone: %lu executions in %.1f s (%.0f/s) with %d threads, %lu harness anomalies\n",
+            execs, elapsed, execs / elapsed, started, atomic_load(&campaign.anomalies));
+
+    for(int i = 0; i < started; i++)
+    {
+        fprintf(stderr, " - thread %d: %lu executions, %lu steals\n",
+                i, campaign.workers[i].execs, campaign.workers[i].steals);
+    }
+
+    for(int i = 0; i < campaign.num_workers; i++)
+    {
+        pthread_mutex_destroy(&campaign.workers[i].deque.lock);
+        free(campaign.workers[i].deque.tasks);
+    }
+    free(campaign.workers);
+    for(int i = 0; i < campaign.num_seeds; i++) input_unload(&campaign.seeds[i].input);
+    free(campaign.seeds);
+    harness_thread_cleanup();
+
+    return 0;
+}
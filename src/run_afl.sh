@@ -11,11 +11,25 @@ fi
 
 RUN_NUMBER=$1
 
+# Persistent mode (shared memory test cases, no fork per execution) is the default,
+# set PERSISTENT=0 to run the one-input-per-process builds reading @@ from disk
+if [ -z ${PERSISTENT+x} ]; then
+    PERSISTENT=1
+fi
+
+if [ $PERSISTENT = 1 ]; then
+    TARGET_PREFIX="./fuzz/afl_persistent_generic_test"
+    TARGET_ARGS=""
+else
+    TARGET_PREFIX="./fuzz/afl_generic_test"
+    TARGET_ARGS="@@"
+fi
+
 mkdir -p afl_output_dir$RUN_NUMBER
 
-afl-fuzz -M main-$HOSTNAME  -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ./fuzz/afl_generic_test_nosan.fuzz @@ > afl_output_dir$RUN_NUMBER/main-$HOSTNAME.log 2>&1 &
+afl-fuzz -M main-$HOSTNAME  -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ${TARGET_PREFIX}_nosan.fuzz $TARGET_ARGS > afl_output_dir$RUN_NUMBER/main-$HOSTNAME.log 2>&1 &
 # Run the other afl-fuzz instances in the background
-afl-fuzz -S slave-1 -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ./fuzz/afl_generic_test_asan.fuzz @@ > afl_output_dir$RUN_NUMBER/slave-1.log 2>&1 &
-afl-fuzz -S slave-2 -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ./fuzz/afl_generic_test_msan.fuzz @@ > afl_output_dir$RUN_NUMBER/slave-2.log 2>&1 &
-afl-fuzz -S slave-3 -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ./fuzz/afl_generic_test_nosan.fuzz @@ > afl_output_dir$RUN_NUMBER/slave-3.log 2>&1 &
-afl-fuzz -S slave-4 -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ./fuzz/afl_generic_test_nosan.fuzz @@ > afl_output_dir$RUN_NUMBER/slave-4.log 2>&1 &
\ No newline at end of file
+afl-fuzz -S slave-1 -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ${TARGET_PREFIX}_asan.fuzz $TARGET_ARGS > afl_output_dir$RUN_NUMBER/slave-1.log 2>&1 &
+afl-fuzz -S slave-2 -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ${TARGET_PREFIX}_msan.fuzz $TARGET_ARGS > afl_output_dir$RUN_NUMBER/slave-2.log 2>&1 &
+afl-fuzz -S slave-3 -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ${TARGET_PREFIX}_nosan.fuzz $TARGET_ARGS > afl_output_dir$RUN_NUMBER/slave-3.log 2>&1 &
+afl-fuzz -S slave-4 -i $INPUT_DIR/ -o afl_output_dir$RUN_NUMBER/ ${TARGET_PREFIX}_nosan.fuzz $TARGET_ARGS > afl_output_dir$RUN_NUMBER/slave-4.log 2>&1 &
\ No newline at end of file
@@ -76,6 +76,18 @@ if [ -z ${SINGLE_IMAGE+x} ]; then
         SINGLE_IMAGE=0
 fi
 
+# Set FORKSERVER=1 to start the test once as a fork server (--server, generic_test
+# only): zzuf mutates the image with in_out and the client submits it to the server
+if [ -z ${FORKSERVER+x} ]; then
+        FORKSERVER=0
+fi
+
+# SINGLE_IMAGE tests have no input file for in_out to mutate and submit to the server
+if [ $FORKSERVER = 1 ] && [ $SINGLE_IMAGE = 1 ]; then
+    echo "FORKSERVER=1 is not supported with SINGLE_IMAGE=1"
+    exit 1
+fi
+
 
 mkdir output > /dev/null 2>&1 || true
 # !!! Add or change fuzzer cases here
@@ -97,6 +109,24 @@ zzuf)
     START=$(cat /dev/random | head -c 4 | xxd -p)
     START=$((16#$START))
 
+    if [ $FORKSERVER = 1 ]; then
+        make fuzz/forkserver_client.fuzz || exit 1
+
+        socket="$output_dir/forkserver_$$.sock"
+        LD_LIBRARY_PATH=libspng/build $test_file --server $socket > /dev/null 2>&1 &
+        server_pid=$!
+        trap "kill $server_pid 2>/dev/null; rm -f $socket" EXIT
+
+        # Wait for the server to listen
+        while [ ! -S $socket ]; do
+            if ! kill -0 $server_pid 2>/dev/null; then
+                echo "Fork server failed to start"
+                exit 1
+            fi
+            sleep 0.1
+        done
+    fi
+
     if [ $SINGLE_IMAGE = 1 ]; then
         for i in $(seq $START $((START + NUM_RUNS - 1))); do
             command="zzuf ${opts[@]} -s $i $test_file"
@@ -119,6 +149,10 @@ zzuf)
                 command="zzuf ${opts[@]} -s $i $test_file $img_path"
                 if [ "$SANITIZER" = "valgrind" ]; then
                     OUTPUT=$(LD_LIBRARY_PATH=libspng/build valgrind --leak-check=full --error-exitcode=1 --trace-children=yes --show-leak-kinds=all $command 2>&1)
+                elif [ $FORKSERVER = 1 ]; then
+                    zzuf ${opts[@]} -s $i fuzz/in_out.fuzz $img_path "${img_path}_TMP" > /dev/null 2>&1
+                    OUTPUT=$(fuzz/forkserver_client.fuzz $socket "${img_path}_TMP" 4000 2>&1)
+                    rm "${img_path}_TMP"
                 elif [ "$SANITIZER" = "asan" ]; then
                     zzuf ${opts[@]} -s $i fuzz/in_out.fuzz $img_path "${img_path}_TMP" > /dev/null 2>&1
                     OUTPUT=$(LD_LIBRARY_PATH=libspng/build $test_file "${img_path}_TMP" 2>&1)
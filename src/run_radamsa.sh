@@ -23,6 +23,19 @@ SEED_DIR="./images"
 SAVE_ALL_LOGS=0  # Set to 1 to save all logs, including successful runs
 SAVE_IMAGES=0  # Set to 1 to save all mutated images
 
+# Set FORKSERVER=1 to start the executable once as a fork server (--server,
+# generic_test only) and submit every mutated file to it with the client,
+# instead of starting a new process per file
+if [ -z ${FORKSERVER+x} ]; then
+    FORKSERVER=0
+fi
+
+# Set BATCH=1 to run all the mutated files of a seed with one call of the
+# executable (--batch, generic_test only), which forks a child per file
+if [ -z ${BATCH+x} ]; then
+    BATCH=0
+fi
+
 # Directories to save mutated files and crash logs
 RADAMSA_DIR="./tmp/radamsa_$SANITIZER" 
 MUTATED_DIR="$RADAMSA_DIR/mutated"
@@ -30,15 +43,116 @@ TMP_LOG_FILE="$RADAMSA_DIR/tmp_log.txt"
 LOG_FILE="$RADAMSA_DIR/logs.txt"
 ERROR_LOG_DIR="$RADAMSA_DIR/error_logs"
 SEGM_FAULT_LOG_DIR="$RADAMSA_DIR/seg_fault_logs"
+HANG_LOG_DIR="$RADAMSA_DIR/hang_logs"
+BATCH_LOG_DIR="$RADAMSA_DIR/batch_logs"
 
 ERROR_CRASH_REPORT="$ERROR_LOG_DIR/_crash_report.txt"
 SEGM_FAULT_CRASH_REPORT="$SEGM_FAULT_LOG_DIR/_crash_report.txt"
+HANG_REPORT="$HANG_LOG_DIR/_hang_report.txt"
 
 rm -rf $RADAMSA_DIR
 
 mkdir -p $MUTATED_DIR
 mkdir -p $ERROR_LOG_DIR
 mkdir -p $SEGM_FAULT_LOG_DIR
+mkdir -p $HANG_LOG_DIR
+
+if [ $BATCH -eq 1 ]; then
+    mkdir -p $BATCH_LOG_DIR
+elif [ $FORKSERVER -eq 1 ]; then
+    make fuzz/forkserver_client.fuzz || exit 1
+
+    SOCKET="$RADAMSA_DIR/forkserver.sock"
+    LD_LIBRARY_PATH=libspng/build $EXECUTABLE --server $SOCKET > /dev/null 2>&1 &
+    SERVER_PID=$!
+    trap "kill $SERVER_PID 2>/dev/null" EXIT
+
+    # Wait for the server to listen
+    while [ ! -S $SOCKET ]; do
+        if ! kill -0 $SERVER_PID 2>/dev/null; then
+            echo "Fork server failed to start"
+            exit 1
+        fi
+        sleep 0.1
+    done
+fi
+
+# Record the result of one mutated file: handle_result <mutated_file> <exit_status> <output_file>
+handle_result() {
+    local MUTATED_FILE=$1
+    local EXIT_STATUS=$2
+    local OUTPUT_FILE=$3
+
+    if [ $SAVE_ALL_LOGS -eq 1 ]; then
+        # Save all logs
+        echo "Seed number $SEED_NUMBER for seed file: $SEED_NAME!" >> $LOG_FILE
+        echo "Counter at: $COUNTER" >> $LOG_FILE
+        echo "Mutated File: $MUTATED_FILE" >> $LOG_FILE
+        echo "Exit Status: $EXIT_STATUS" >> $LOG_FILE
+        echo "Output:" >> $LOG_FILE
+        cat $OUTPUT_FILE >> $LOG_FILE
+        echo "----------------------------------------------------" >> $LOG_FILE
+    fi
+    
+    # Print the current mutation count on the same line
+    COUNTER=$((COUNTER + 1))
+    
+    if [ $EXIT_STATUS -eq 139 ]; then
+        # Increment the segmentation fault count
+        COUNTER_SEG_FAULTS=$((COUNTER_SEG_FAULTS + 1))
+
+        # Log the segmentation fault and the mutated file
+        echo "Segmentation fault detected on seed number $SEED_NUMBER for seed file: $SEED_NAME!" >> $SEGM_FAULT_CRASH_REPORT
+        echo "Counter at: $COUNTER" >> $SEGM_FAULT_CRASH_REPORT
+        echo "Mutated File: $MUTATED_FILE" >> $SEGM_FAULT_CRASH_REPORT
+        echo "Exit Status: $EXIT_STATUS" >> $SEGM_FAULT_CRASH_REPORT
+        echo "Error Output:" >> $SEGM_FAULT_CRASH_REPORT
+        cat $OUTPUT_FILE >> $SEGM_FAULT_CRASH_REPORT
+        echo "----------------------------------------------------" >> $SEGM_FAULT_CRASH_REPORT
+
+        if [ $SAVE_IMAGES -eq 1 ]; then
+            # Save the file with a unique name based on the total counter
+            cp $MUTATED_FILE $SEGM_FAULT_LOG_DIR/${SEED_NAME}_$COUNTER.png
+        fi
+
+    elif [ $EXIT_STATUS -eq 124 ]; then
+        # Slow inputs: stopped by the watchdog of generic_test (with the libspng
+        # call in progress in the output) or by the timeout
+        COUNTER_HANGS=$((COUNTER_HANGS + 1))
+
+        echo "Timeout reached for file: $MUTATED_FILE" >> $LOG_FILE
+
+        echo "Hang detected on seed number $SEED_NUMBER for seed file: $SEED_NAME!" >> $HANG_REPORT
+        echo "Counter at: $COUNTER" >> $HANG_REPORT
+        echo "Mutated File: $MUTATED_FILE" >> $HANG_REPORT
+        echo "Output:" >> $HANG_REPORT
+        cat $OUTPUT_FILE >> $HANG_REPORT
+        echo "----------------------------------------------------" >> $HANG_REPORT
+
+        if [ $SAVE_IMAGES -eq 1 ]; then
+            # Save the file with a unique name based on the total counter
+            cp $MUTATED_FILE $HANG_LOG_DIR/${SEED_NAME}_$COUNTER.png
+        fi
+
+    elif [ $EXIT_STATUS -ne 0 ]; then
+        # Increment the error count
+        COUNTER_ERRORS=$((COUNTER_ERRORS + 1))
+
+        # Log the crash or other errors and the mutated file
+        echo "Error detected on seed number $SEED_NUMBER for seed file: $SEED_NAME!" >> $ERROR_CRASH_REPORT
+        echo "Counter at: $COUNTER" >> $ERROR_CRASH_REPORT
+        echo "Mutated File: $MUTATED_FILE" >> $ERROR_CRASH_REPORT
+        echo "Exit Status: $EXIT_STATUS" >> $ERROR_CRASH_REPORT
+        echo "Error Output:" >> $ERROR_CRASH_REPORT
+        cat $OUTPUT_FILE >> $ERROR_CRASH_REPORT
+        echo "----------------------------------------------------" >> $ERROR_CRASH_REPORT
+
+        if [ $SAVE_IMAGES -eq 1 ]; then
+            # Save the file with a unique name based on the total counter
+            cp $MUTATED_FILE $ERROR_LOG_DIR/${SEED_NAME}_$COUNTER.png
+        fi
+    fi
+}
 
 # Initialize mutation count
 COUNTER=0
@@ -46,6 +160,7 @@ SEED_NUMBER=0
 MUTATIONS_PER_SEED_FILE=1000  # Number of mutations per seed file
 COUNTER_ERRORS=0
 COUNTER_SEG_FAULTS=0
+COUNTER_HANGS=0
 
 START_TIME=$(date +%s)
 
@@ -71,68 +186,38 @@ while true; do
             continue
         fi
 
-        for MUTATED_FILE in $MUTATED_DIR/*; do
-            # Run the mutated file through the program that uses libspng
-            timeout 4s $EXECUTABLE $MUTATED_FILE > $TMP_LOG_FILE 2>&1
-            EXIT_STATUS=$?
-
-            if [ $SAVE_ALL_LOGS -eq 1 ]; then
-                # Save all logs
-                echo "Seed number $SEED_NUMBER for seed file: $SEED_NAME!" >> $LOG_FILE
-                echo "Counter at: $COUNTER" >> $LOG_FILE
-                echo "Mutated File: $MUTATED_FILE" >> $LOG_FILE
-                echo "Exit Status: $EXIT_STATUS" >> $LOG_FILE
-                echo "Output:" >> $LOG_FILE
-                cat $TMP_LOG_FILE >> $LOG_FILE
-                echo "----------------------------------------------------" >> $LOG_FILE
-            fi
-            
-            # Print the current mutation count on the same line
-            COUNTER=$((COUNTER + 1))
-            
-            if [ $EXIT_STATUS -eq 139 ]; then
-                # Increment the segmentation fault count
-                COUNTER_SEG_FAULTS=$((COUNTER_SEG_FAULTS + 1))
-
-                # Log the segmentation fault and the mutated file
-                echo "Segmentation fault detected on seed number $SEED_NUMBER for seed file: $SEED_NAME!" >> $SEGM_FAULT_CRASH_REPORT
-                echo "Counter at: $COUNTER" >> $SEGM_FAULT_CRASH_REPORT
-                echo "Mutated File: $MUTATED_FILE" >> $SEGM_FAULT_CRASH_REPORT
-                echo "Exit Status: $EXIT_STATUS" >> $SEGM_FAULT_CRASH_REPORT
-                echo "Error Output:" >> $SEGM_FAULT_CRASH_REPORT
-                cat $TMP_LOG_FILE >> $SEGM_FAULT_CRASH_REPORT
-                echo "----------------------------------------------------" >> $SEGM_FAULT_CRASH_REPORT
-
-                if [ $SAVE_IMAGES -eq 1 ]; then
-                    # Save the file with a unique name based on the total counter
-                    cp $MUTATED_FILE $SEGM_FAULT_LOG_DIR/${SEED_NAME}_$COUNTER.png
+        if [ $BATCH -eq 1 ]; then
+            # One record "<index> <status> <file>" per mutated file, the output
+            # of the failed ones is kept as <index>.log
+            rm -f $BATCH_LOG_DIR/*
+            while read INDEX EXIT_STATUS MUTATED_FILE; do
+                if [ -f $BATCH_LOG_DIR/$INDEX.log ]; then
+                    OUTPUT_FILE=$BATCH_LOG_DIR/$INDEX.log
+                else
+                    OUTPUT_FILE=/dev/null
                 fi
+                handle_result $MUTATED_FILE $EXIT_STATUS $OUTPUT_FILE
+                echo -ne "Counter $COUNTER - Mutating $SEED_NAME - Errors $COUNTER_ERRORS - Segm. faults $COUNTER_SEG_FAULTS - Hangs $COUNTER_HANGS - time: $(( $(date +%s) - $START_TIME ))\r"
+            done < <(LD_LIBRARY_PATH=libspng/build $EXECUTABLE --batch $MUTATED_DIR $BATCH_LOG_DIR 2> /dev/null)
 
-            elif [ $EXIT_STATUS -ne 0 ]; then
-                # Increment the error count
-                COUNTER_ERRORS=$((COUNTER_ERRORS + 1))
-
-                if [ $EXIT_STATUS -eq 124 ]; then
-                    echo "Timeout reached for file: $MUTATED_FILE" >> $LOG_FILE
-                fi
+            rm -f $MUTATED_DIR/*
+            continue
+        fi
 
-                # Log the crash or other errors and the mutated file
-                echo "Error detected on seed number $SEED_NUMBER for seed file: $SEED_NAME!" >> $ERROR_CRASH_REPORT
-                echo "Counter at: $COUNTER" >> $ERROR_CRASH_REPORT
-                echo "Mutated File: $MUTATED_FILE" >> $ERROR_CRASH_REPORT
-                echo "Exit Status: $EXIT_STATUS" >> $ERROR_CRASH_REPORT
-                echo "Error Output:" >> $ERROR_CRASH_REPORT
-                cat $TMP_LOG_FILE >> $ERROR_CRASH_REPORT
-                echo "----------------------------------------------------" >> $ERROR_CRASH_REPORT
-
-                if [ $SAVE_IMAGES -eq 1 ]; then
-                    # Save the file with a unique name based on the total counter
-                    cp $MUTATED_FILE $ERROR_LOG_DIR/${SEED_NAME}_$COUNTER.png
-                fi
+        for MUTATED_FILE in $MUTATED_DIR/*; do
+            # Run the mutated file through the program that uses libspng
+            # (the client exits with the same status, 124 on timeout)
+            if [ $FORKSERVER -eq 1 ]; then
+                fuzz/forkserver_client.fuzz $SOCKET $MUTATED_FILE 4000 > $TMP_LOG_FILE 2>&1
+            else
+                timeout 4s $EXECUTABLE $MUTATED_FILE > $TMP_LOG_FILE 2>&1
             fi
+            EXIT_STATUS=$?
+
+            handle_result $MUTATED_FILE $EXIT_STATUS $TMP_LOG_FILE
 
             # Print the current mutation count on the same line
-            echo -ne "Counter $COUNTER - Mutating $SEED_NAME - Errors $COUNTER_ERRORS - Segm. faults $COUNTER_SEG_FAULTS - time: $(( $(date +%s) - $START_TIME ))\r"
+            echo -ne "Counter $COUNTER - Mutating $SEED_NAME - Errors $COUNTER_ERRORS - Segm. faults $COUNTER_SEG_FAULTS - Hangs $COUNTER_HANGS - time: $(( $(date +%s) - $START_TIME ))\r"
             
         done  # Inner for loop for all mutated files
         